@@ -33,15 +33,19 @@ public:
                 { 13, "Something didn't go here" },
                 { 23, "Something wnt wrong here" },
             }); }),
-            A_("Clear line hints", this, [this]{ editor->setLineHints({}); }),
+            A_("Clear line hints", this, [this]{ editor->clearLineHints(); }),
             ________
             C_("Show Whitespaces", editor->showWhitespaces(), this, [this]{
                 editor->setShowWhitespaces(!editor->showWhitespaces());
             }),
+            C_("Show Minimap", editor->showMinimap(), this, [this]{
+                editor->setShowMinimap(!editor->showMinimap());
+            }),
             ________
             A_("Folding Type: None", this, [this]{ editor->setFoldingType(Ori::Widgets::CodeEditor::FOLD_NONE); }),
             A_("Folding Type: Python", this, [this]{ editor->setFoldingType(Ori::Widgets::CodeEditor::FOLD_PYTHON); }),
             A_("Fold", this, [this]{ editor->fold(); }),
+            A_("Fold All", this, [this]{ editor->foldAll(); }),
             A_("Unfold", this, [this]{ editor->unfold(); }),
             A_("Unfold All", this, [this]{ editor->unfoldAll(); }),
         });
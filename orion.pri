@@ -29,9 +29,13 @@ HEADERS += \
     $$PWD/core/OriResult.h \
     $$PWD/dialogs/OriConfigDlg.h \
     $$PWD/helpers/OriTheme.h \
+    $$PWD/tools/OriCodeSearch.h \
+    $$PWD/tools/OriExtraSelections.h \
     $$PWD/tools/OriHighlighter.h \
     $$PWD/tools/OriMessageBus.h \
     $$PWD/tools/OriPetname.h \
+    $$PWD/tools/OriTextEdits.h \
+    $$PWD/tools/OriWorkerLink.h \
     $$PWD/widgets/OriActions.h \
     $$PWD/widgets/OriCodeEditor.h \
     $$PWD/widgets/OriColorSelectors.h \
@@ -77,6 +81,8 @@ SOURCES += \
     $$PWD/dialogs/OriConfigDlg.cpp \
     $$PWD/helpers/OriLayouts.cpp \
     $$PWD/helpers/OriTheme.cpp \
+    $$PWD/tools/OriCodeSearch.cpp \
+    $$PWD/tools/OriExtraSelections.cpp \
     $$PWD/tools/OriHighlighter.cpp \
     $$PWD/tools/OriMessageBus.cpp \
     $$PWD/tools/OriPetname.cpp \
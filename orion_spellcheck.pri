@@ -11,11 +11,12 @@ SOURCES += \
 
 HEADERS += \
     $$PWD/tools/OriSpellcheck.h \
-    $$PWD/tools/OriSpellcheckEngine.h
+    $$PWD/tools/OriSpellcheckEngine.h \
+    $$PWD/tools/OriSpellcheckWords.h
 
 INCLUDEPATH += $$PWD/hunspell/src
 
-DEFINES += HUNSPELL_STATIC
+DEFINES += HUNSPELL_STATIC ORI_USE_SPELLCHECK
 
 HEADERS += \
     $$PWD/hunspell/src/hunspell/affentry.hxx \
@@ -5,4 +5,12 @@ SOURCES += \
     $$PWD/tests/ori_test_Templates.cpp \
     $$PWD/tests/ori_test_Version.cpp \
     $$PWD/tests/ori_test_Filter.cpp \
-    $$PWD/tests/ori_test_Math.cpp
+    $$PWD/tests/ori_test_Math.cpp \
+    $$PWD/tests/ori_test_Highlighter.cpp \
+    $$PWD/tests/ori_test_CodeEditor.cpp \
+    $$PWD/tests/ori_test_CodeSearch.cpp
+
+# orion_spellcheck.pri should be included before this file to get spellcheck tests
+contains(DEFINES, ORI_USE_SPELLCHECK) {
+    SOURCES += $$PWD/tests/ori_test_Spellcheck.cpp
+}
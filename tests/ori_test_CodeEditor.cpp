@@ -0,0 +1,284 @@
+#include "../testing/OriTestBase.h"
+#include "../widgets/OriCodeEditor.h"
+
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QTemporaryDir>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QThreadPool>
+#include <QTimer>
+
+namespace Ori {
+namespace Tests {
+namespace CodeEditorTests {
+
+using Ori::Widgets::CodeEditor;
+
+static QString hintsStr(const QMap<int, QString>& hints)
+{
+    QStringList s;
+    for (auto it = hints.constBegin(); it != hints.constEnd(); it++)
+        s << QString("%1:%2").arg(it.key()).arg(it.value());
+    return s.join(' ');
+}
+
+static QString readFile(const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly | QFile::Text))
+        return QString();
+    return QString::fromUtf8(file.readAll());
+}
+
+// Selects lines [first, last], line numbers are 1-based
+static void selectLines(CodeEditor& editor, int first, int last)
+{
+    auto doc = editor.document();
+    QTextCursor cursor(doc->findBlockByNumber(first-1));
+    auto end = doc->findBlockByNumber(last-1);
+    cursor.setPosition(end.position() + end.length() - 1, QTextCursor::KeepAnchor);
+    editor.setTextCursor(cursor);
+}
+
+// Shows the editor off-screen, so it lays out its panels as it does on screen
+static void showMinimap(CodeEditor& editor, const QString& text)
+{
+    editor.setAttribute(Qt::WA_DontShowOnScreen);
+    editor.setShowMinimap(true);
+    editor.resize(400, 240);
+    editor.setPlainText(text);
+    editor.show();
+}
+
+static QImage minimapImage(CodeEditor& editor)
+{
+    auto minimap = editor.findChild<QWidget*>("minimap");
+    return minimap ? minimap->grab().toImage() : QImage();
+}
+
+static QString numberedLines(int count)
+{
+    QStringList lines;
+    for (int i = 0; i < count; i++)
+        lines << QString(i % 7, ' ') + QString("line %1").arg(i) + QString(i % 13, 'x');
+    return lines.join('\n');
+}
+
+//------------------------------------------------------------------------------
+
+TEST_METHOD(line_hints_must_move_along_with_lines)
+{
+    CodeEditor editor;
+    editor.setPlainText("a\nbb\nc\nd");
+    editor.setLineHints({{2, "B"}, {3, "C"}, {4, "D"}});
+    auto doc = editor.document();
+
+    QTextCursor cursor(doc->firstBlock());
+    cursor.movePosition(QTextCursor::EndOfBlock);
+    cursor.insertText("\nx");
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "3:B 4:C 5:D")
+
+    cursor.setPosition(doc->findBlockByNumber(2).position());
+    cursor.insertText("z");
+    ASSERT_EQ_STR(doc->findBlockByNumber(2).text(), "zbb")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "3:B 4:C 5:D")
+
+    // A hint is lost along with its line
+    cursor.setPosition(doc->findBlockByNumber(3).position());
+    cursor.select(QTextCursor::BlockUnderCursor);
+    cursor.removeSelectedText();
+    ASSERT_EQ_STR(editor.toPlainText(), "a\nx\nzbb\nd")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "3:B 4:D")
+
+    // Joined lines keep the hint of the first one
+    cursor.setPosition(doc->findBlockByNumber(2).position());
+    cursor.movePosition(QTextCursor::EndOfBlock);
+    cursor.deleteChar();
+    ASSERT_EQ_STR(editor.toPlainText(), "a\nx\nzbbd")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "3:B")
+
+    editor.setLineHints({{1, "A"}, {10, "out of document"}});
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "1:A")
+}
+
+TEST_METHOD(indentSelection_must_keep_line_hints)
+{
+    CodeEditor editor;
+    editor.setPlainText("a\nb\nc\nd\ne\nf");
+    editor.setLineHints({{1, "A"}, {3, "C"}, {5, "E"}});
+
+    selectLines(editor, 2, 5);
+    editor.indentSelection();
+
+    ASSERT_EQ_STR(editor.toPlainText(), "a\n    b\n    c\n    d\n    e\nf")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "1:A 3:C 5:E")
+
+    selectLines(editor, 3, 6);
+    editor.unindentSelection();
+
+    ASSERT_EQ_STR(editor.toPlainText(), "a\n    b\nc\nd\ne\nf")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "1:A 3:C 5:E")
+
+    editor.clearLineHints();
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "")
+}
+
+TEST_METHOD(normalize_must_keep_line_hints)
+{
+    CodeEditor editor;
+    editor.setPlainText("a  \nb\t\nc \nd");
+    editor.setLineHints({{2, "B"}, {4, "D"}});
+
+    editor.normalize(CodeEditor::NormTrailingSpaces);
+
+    ASSERT_EQ_STR(editor.toPlainText(), "a\nb\nc\nd")
+    ASSERT_EQ_STR(hintsStr(editor.lineHints()), "2:B 4:D")
+}
+
+TEST_METHOD(code_must_unfold_folds_moved_by_edits)
+{
+    const QString text =
+        "def a():\n"
+        "    x = 1\n"
+        "    y = 2\n"
+        "def b():\n"
+        "    z = 3\n"
+        "end";
+    CodeEditor editor;
+    editor.setPlainText(text);
+    editor.setFoldingType(CodeEditor::FOLD_PYTHON);
+
+    editor.foldAll();
+    ASSERT_EQ_INT(editor.toPlainText().count(QChar::ObjectReplacementCharacter), 2)
+    ASSERT_EQ_INT(editor.blockCount(), 3)
+    ASSERT_EQ_STR(editor.code(), text)
+
+    // Edits before and between folds shift positions of the following folds
+    QTextCursor cursor(editor.document());
+    cursor.insertText("# top\n");
+    cursor.setPosition(editor.document()->findBlockByNumber(2).position());
+    cursor.insertText("c = 0\n");
+    ASSERT_EQ_STR(editor.code(), "# top\n" + QString(text).replace("def b", "c = 0\ndef b"))
+
+    // Removed folds are dropped from the index, and undo brings them back
+    cursor.setPosition(editor.document()->findBlockByNumber(1).position());
+    cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+    ASSERT_EQ_STR(editor.code(), "# top\nc = 0\ndef b():\n    z = 3\nend")
+    editor.undo();
+    ASSERT_EQ_STR(editor.code(), "# top\n" + QString(text).replace("def b", "c = 0\ndef b"))
+
+    editor.unfoldAll();
+    ASSERT_EQ_INT(editor.toPlainText().count(QChar::ObjectReplacementCharacter), 0)
+    ASSERT_EQ_STR(editor.toPlainText(), editor.code())
+}
+
+TEST_METHOD(saveCodeAsync_must_write_all_requested_files)
+{
+    QTemporaryDir dir;
+    ASSERT_IS_TRUE(dir.isValid())
+    auto fileA = dir.filePath("a.txt");
+    auto fileB = dir.filePath("b.txt");
+
+    CodeEditor editor;
+    QStringList finished;
+    QEventLoop loop;
+    QObject::connect(&editor, &CodeEditor::savingFinished, &loop,
+        [&](const QString &fileName, const QString &error){
+            finished << QFileInfo(fileName).fileName() + error;
+            if (!editor.isSaving())
+                loop.exit(0);
+        });
+    QTimer::singleShot(10000, &loop, [&loop]{ loop.exit(1); });
+
+    // The first save is in progress, then the others are postponed,
+    // a postponed save of the same file is replaced with the latest one
+    editor.setPlainText("one");
+    editor.saveCodeAsync(fileA);
+    editor.setPlainText("two");
+    editor.saveCodeAsync(fileB);
+    editor.setPlainText("three");
+    editor.saveCodeAsync(fileA);
+    editor.setPlainText("four");
+    editor.saveCodeAsync(fileB);
+    ASSERT_EQ_INT(loop.exec(), 0)
+
+    ASSERT_EQ_STR(finished.join(' '), "a.txt b.txt a.txt")
+    ASSERT_EQ_STR(readFile(fileA), "three")
+    ASSERT_EQ_STR(readFile(fileB), "four")
+}
+
+TEST_METHOD(saveCode_must_supersede_earlier_async_saves)
+{
+    QTemporaryDir dir;
+    ASSERT_IS_TRUE(dir.isValid())
+    auto fileA = dir.filePath("a.txt");
+    auto fileB = dir.filePath("b.txt");
+
+    {
+        CodeEditor editor;
+        editor.setPlainText("one");
+        editor.saveCodeAsync(fileA);
+        editor.setPlainText("two");
+        editor.saveCodeAsync(fileB);
+        editor.saveCodeAsync(fileA);
+        editor.setPlainText("three");
+        ASSERT_IS_TRUE(editor.saveCode(fileA))
+        ASSERT_EQ_STR(readFile(fileA), "three")
+        // The postponed save of the other file is written even though the editor is deleted
+    }
+    QThreadPool::globalInstance()->waitForDone();
+    ASSERT_EQ_STR(readFile(fileA), "three")
+    ASSERT_EQ_STR(readFile(fileB), "two")
+}
+
+TEST_METHOD(minimap_must_be_the_same_after_edits_as_after_reload)
+{
+    // Short documents have a row per line, long ones have several lines per row
+    for (int lineCount : {20, 1000})
+    {
+        TEST_LOG_VALUE(lineCount)
+        CodeEditor editor;
+        showMinimap(editor, numberedLines(lineCount));
+        ASSERT_IS_FALSE(minimapImage(editor).isNull())
+
+        // Inserted and removed lines shift rows, other changes invalidate only their rows
+        auto doc = editor.document();
+        QTextCursor cursor(doc->findBlockByNumber(5));
+        cursor.insertText("        inserted\n    lines\n");
+        minimapImage(editor);
+        cursor.setPosition(doc->findBlockByNumber(lineCount / 2).position());
+        cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor, 3);
+        cursor.removeSelectedText();
+        minimapImage(editor);
+        cursor.setPosition(doc->findBlockByNumber(1).position());
+        cursor.insertText("            ");
+        cursor.setPosition(doc->lastBlock().position());
+        cursor.movePosition(QTextCursor::EndOfBlock, QTextCursor::KeepAnchor);
+        cursor.insertText("x");
+        auto edited = minimapImage(editor);
+
+        CodeEditor reloaded;
+        showMinimap(reloaded, editor.toPlainText());
+        ASSERT_IS_TRUE(edited == minimapImage(reloaded))
+    }
+}
+
+//------------------------------------------------------------------------------
+
+TEST_GROUP("CodeEditor",
+    ADD_GUI_TEST(line_hints_must_move_along_with_lines),
+    ADD_GUI_TEST(indentSelection_must_keep_line_hints),
+    ADD_GUI_TEST(normalize_must_keep_line_hints),
+    ADD_GUI_TEST(code_must_unfold_folds_moved_by_edits),
+    ADD_GUI_TEST(saveCodeAsync_must_write_all_requested_files),
+    ADD_GUI_TEST(saveCode_must_supersede_earlier_async_saves),
+    ADD_GUI_TEST(minimap_must_be_the_same_after_edits_as_after_reload),
+)
+
+} // namespace CodeEditorTests
+} // namespace Tests
+} // namespace Ori
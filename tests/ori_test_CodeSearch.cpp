@@ -0,0 +1,197 @@
+#include "../testing/OriTestBase.h"
+#include "../tools/OriCodeSearch.h"
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QPlainTextEdit>
+#include <QScrollBar>
+#include <QSyntaxHighlighter>
+#include <QTextBlock>
+#include <QTimer>
+
+namespace Ori {
+namespace Tests {
+namespace CodeSearchTests {
+
+static QString hitsStr(const SearchHits& hits)
+{
+    QStringList s;
+    for (const auto& hit : hits)
+        s << QString("%1:%2").arg(hit.pos).arg(hit.length);
+    return s.join(' ');
+}
+
+// Returns the number of found hits or -1 on timeout
+static int waitFinished(CodeSearch& search)
+{
+    QEventLoop loop;
+    QObject::connect(&search, &CodeSearch::finished, &loop, [&loop](int total){ loop.exit(total); });
+    QTimer::singleShot(10000, &loop, [&loop]{ loop.exit(-1); });
+    return loop.exec();
+}
+
+// Search marks get to the editor in two steps, via the search and via the selection layers
+static void flushMarks()
+{
+    QCoreApplication::processEvents();
+    QCoreApplication::processEvents();
+}
+
+class BoldHighlighter : public QSyntaxHighlighter
+{
+public:
+    using QSyntaxHighlighter::QSyntaxHighlighter;
+protected:
+    void highlightBlock(const QString &text) override
+    {
+        QTextCharFormat f;
+        f.setFontWeight(QFont::Bold);
+        setFormat(0, text.size(), f);
+    }
+};
+
+//------------------------------------------------------------------------------
+
+TEST_METHOD(findAll_must_find_all_hits)
+{
+    QPlainTextEdit editor;
+    editor.setPlainText("Foo foo\nfood foo_ foo");
+    CodeSearch search(&editor);
+
+    ASSERT_IS_FALSE(search.findAll(""))
+    ASSERT_IS_FALSE(search.findAll("(", CodeSearch::Regex))
+
+    ASSERT_IS_TRUE(search.findAll("foo"))
+    ASSERT_EQ_INT(waitFinished(search), 5)
+    ASSERT_EQ_STR(hitsStr(search.hits()), "0:3 4:3 8:3 13:3 18:3")
+
+    ASSERT_IS_TRUE(search.findAll("foo", CodeSearch::CaseSensitive | CodeSearch::WholeWords))
+    ASSERT_EQ_INT(waitFinished(search), 2)
+    ASSERT_EQ_STR(hitsStr(search.hits()), "4:3 18:3")
+
+    ASSERT_IS_TRUE(search.findAll("fo+d?", CodeSearch::Regex))
+    ASSERT_EQ_INT(waitFinished(search), 5)
+    ASSERT_EQ_STR(hitsStr(search.hits()), "0:3 4:3 8:4 13:3 18:3")
+}
+
+TEST_METHOD(findAll_must_find_same_whole_words_with_and_without_regex)
+{
+    // Non-ASCII letters are word characters for both kinds of patterns
+    QPlainTextEdit editor;
+    editor.setPlainText(QString::fromUtf8("приветы привет x_привет привет1 привет"));
+    CodeSearch search(&editor);
+
+    ASSERT_IS_TRUE(search.findAll(QString::fromUtf8("привет"), CodeSearch::WholeWords))
+    ASSERT_EQ_INT(waitFinished(search), 2)
+    ASSERT_EQ_STR(hitsStr(search.hits()), "8:6 32:6")
+
+    ASSERT_IS_TRUE(search.findAll(QString::fromUtf8("привет"), CodeSearch::WholeWords | CodeSearch::Regex))
+    ASSERT_EQ_INT(waitFinished(search), 2)
+    ASSERT_EQ_STR(hitsStr(search.hits()), "8:6 32:6")
+}
+
+TEST_METHOD(findAll_must_start_from_visible_area_and_wrap)
+{
+    QStringList lines;
+    for (int i = 0; i < 100; i++)
+        lines << QString("%1 x").arg(i);
+    QPlainTextEdit editor;
+    editor.setPlainText(lines.join('\n'));
+    editor.resize(300, 150);
+    editor.verticalScrollBar()->setValue(50);
+    CodeSearch search(&editor);
+
+    auto doc = editor.document();
+    QVector<int> foundLines;
+    QObject::connect(&search, &CodeSearch::hitsFound, [&](const SearchHits& hits, int){
+        for (const auto& hit : hits)
+            foundLines << doc->findBlock(hit.pos).blockNumber();
+    });
+
+    ASSERT_IS_TRUE(search.findAll("x"))
+    ASSERT_EQ_INT(waitFinished(search), 100)
+
+    // Hits are found from the first visible line, and they are ordered when the search is finished
+    QVector<int> expectedLines;
+    for (int i = 0; i < 100; i++)
+        expectedLines << (i + 50) % 100;
+    ASSERT_IS_TRUE(foundLines == expectedLines)
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQ_INT(doc->findBlock(search.hits().at(i).pos).blockNumber(), i)
+}
+
+TEST_METHOD(replaceAll_must_replace_in_single_undo_step)
+{
+    QPlainTextEdit editor;
+    editor.setPlainText("a1 b2 a3\na4");
+    CodeSearch search(&editor);
+    int invalidated = 0;
+    QObject::connect(&search, &CodeSearch::invalidated, [&invalidated]{ invalidated++; });
+
+    // Nothing to replace until the search is finished
+    ASSERT_IS_TRUE(search.findAll("a(\\d)", CodeSearch::Regex))
+    ASSERT_EQ_INT(search.replaceAll("x"), 0)
+    ASSERT_EQ_INT(waitFinished(search), 3)
+
+    ASSERT_EQ_INT(search.replaceAll("[\\1\\\\\\0]"), 3)
+    ASSERT_EQ_STR(editor.toPlainText(), "[1\\a1] b2 [3\\a3]\n[4\\a4]")
+    ASSERT_EQ_INT(invalidated, 1)
+    ASSERT_IS_TRUE(search.hits().isEmpty())
+
+    editor.undo();
+    ASSERT_EQ_STR(editor.toPlainText(), "a1 b2 a3\na4")
+
+    ASSERT_IS_TRUE(search.findAll("B2"))
+    ASSERT_EQ_INT(waitFinished(search), 1)
+    ASSERT_EQ_INT(search.replaceAll("c"), 1)
+    ASSERT_EQ_STR(editor.toPlainText(), "a1 c a3\na4")
+}
+
+TEST_METHOD(edits_must_invalidate_hits)
+{
+    QPlainTextEdit editor;
+    editor.setPlainText("one two one\nthree one");
+    CodeSearch search(&editor);
+    int invalidated = 0;
+    QObject::connect(&search, &CodeSearch::invalidated, [&invalidated]{ invalidated++; });
+
+    ASSERT_IS_TRUE(search.findAll("one"))
+    ASSERT_EQ_INT(waitFinished(search), 3)
+    flushMarks();
+    ASSERT_EQ_INT(editor.extraSelections().size(), 3)
+
+    // Highlighting changes only formats, hits are still valid
+    BoldHighlighter highlighter(editor.document());
+    highlighter.rehighlight();
+    ASSERT_EQ_INT(invalidated, 0)
+    ASSERT_EQ_INT(search.hits().size(), 3)
+
+    search.setHighlightHits(false);
+    flushMarks();
+    ASSERT_EQ_INT(editor.extraSelections().size(), 0)
+    search.setHighlightHits(true);
+    flushMarks();
+    ASSERT_EQ_INT(editor.extraSelections().size(), 3)
+
+    QTextCursor cursor(editor.document());
+    cursor.insertText("zero ");
+    ASSERT_EQ_INT(invalidated, 1)
+    ASSERT_IS_TRUE(search.hits().isEmpty())
+    ASSERT_IS_FALSE(search.isRunning())
+    flushMarks();
+    ASSERT_EQ_INT(editor.extraSelections().size(), 0)
+}
+
+//------------------------------------------------------------------------------
+
+TEST_GROUP("CodeSearch",
+    ADD_GUI_TEST(findAll_must_find_all_hits),
+    ADD_GUI_TEST(findAll_must_find_same_whole_words_with_and_without_regex),
+    ADD_GUI_TEST(findAll_must_start_from_visible_area_and_wrap),
+    ADD_GUI_TEST(replaceAll_must_replace_in_single_undo_step),
+    ADD_GUI_TEST(edits_must_invalidate_hits),
+)
+
+} // namespace CodeSearchTests
+} // namespace Tests
+} // namespace Ori
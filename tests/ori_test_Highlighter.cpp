@@ -0,0 +1,511 @@
+#include "../testing/OriTestBase.h"
+#include "../tools/OriHighlighter.h"
+
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QTextDocument>
+#include <QTextLayout>
+#include <QTimer>
+#include <QTextStream>
+
+#include <algorithm>
+
+namespace Ori {
+namespace Tests {
+namespace HighlighterTests {
+
+using namespace Ori::Highlighter;
+
+static QSharedPointer<const Spec> parseSpec(QString code)
+{
+    QSharedPointer<Spec> spec(new Spec);
+    loadSpec(spec, &code, false);
+    return spec;
+}
+
+static QSharedPointer<const Spec> makeSpec()
+{
+    return parseSpec(
+        "name: test\n"
+        "\n"
+        "rule: Keyword\n"
+        "terms: if,else\n"
+        "color: #0000ff\n"
+        "\n"
+        "rule: String\n"
+        "expr: \"[^\"]*\"\n"
+        "color: #ff0000\n"
+        "\n"
+        "rule: Comment\n"
+        "opts: multiline\n"
+        "expr: /\\*\n"
+        "expr: \\*/\n"
+        "color: #008000\n");
+}
+
+static QString tokensStr(const FormatRuns& tokens)
+{
+    QStringList s;
+    for (const auto& t : tokens)
+        s << QString("%1:%2:%3").arg(t.start).arg(t.length).arg(t.rule);
+    return s.join(' ');
+}
+
+// Where runs of rules overlap, the rules engine applies the later rule, while the scanner
+// takes the earliest match, so engines are expected to give the same tokens only without overlaps
+static bool hasOverlaps(const FormatRuns& runs)
+{
+    QVector<QPair<int, int>> ranges;
+    for (const auto& run : runs)
+        if (run.length > 0)
+            ranges << qMakePair(run.start, run.start + run.length);
+    std::sort(ranges.begin(), ranges.end());
+    for (int i = 1; i < ranges.size(); i++)
+        if (ranges.at(i).first < ranges.at(i-1).second)
+            return true;
+    return false;
+}
+
+// Multiline openers hidden inside strings and strings inside comments,
+// so states are only correct when tokens are taken into account
+static QString makeDeferredSpecCode()
+{
+    return
+        "name: test\n"
+        "\n"
+        "rule: String\n"
+        "expr: \"[^\"]*\"\n"
+        "color: #ff0000\n"
+        "\n"
+        "rule: Keyword\n"
+        "terms: if,else\n"
+        "color: #0000ff\n"
+        "\n"
+        "rule: Comment\n"
+        "opts: multiline\n"
+        "expr: /\\*\n"
+        "expr: \\*/\n"
+        "color: #008000\n";
+}
+
+static QString makeDeferredText(int repeats)
+{
+    QStringList lines;
+    for (int i = 0; i < repeats; i++)
+        lines << "if x else y"
+              << "s = \"/* not a comment\""
+              << "/* comment \"if"
+              << "else \" */ if \"*/\""
+              << "x /* a */ y /* b"
+              << "c */ else";
+    return lines.join('\n');
+}
+
+static QString blockFormatsStr(const QTextBlock& block)
+{
+    QStringList s;
+    s << QString::number(block.userState());
+    for (const auto& r : block.layout()->formats())
+        s << QString("%1:%2:%3").arg(r.start).arg(r.length).arg(r.format.foreground().color().name());
+    return s.join(' ');
+}
+
+// Returns the number of the first block formatted differently or -1
+static int compareFormats(QTextDocument& expected, QTextDocument& actual)
+{
+    if (expected.blockCount() != actual.blockCount())
+        return 0;
+    for (auto b1 = expected.begin(), b2 = actual.begin(); b1.isValid(); b1 = b1.next(), b2 = b2.next())
+        if (b1.text() != b2.text() || blockFormatsStr(b1) != blockFormatsStr(b2))
+            return b1.blockNumber();
+    return -1;
+}
+
+static bool waitDeferredFinished(Highlighter& highlighter, int timeoutMs = 10000)
+{
+    QEventLoop loop;
+    QTimer::singleShot(timeoutMs, &loop, [&loop]{ loop.exit(1); });
+    QObject::connect(&highlighter, &Highlighter::deferredFinished, &loop, [&loop]{ loop.exit(0); });
+    return loop.exec() == 0;
+}
+
+//------------------------------------------------------------------------------
+
+TEST_METHOD(tokenize_must_find_terms)
+{
+    Tokenizer tokenizer(makeSpec());
+
+    auto tokens = tokenizer.tokenize("if x else y");
+
+    ASSERT_EQ_STR(tokensStr(tokens), "0:2:0 5:4:0")
+}
+
+TEST_METHOD(tokenize_must_prefer_later_rule)
+{
+    Tokenizer tokenizer(makeSpec());
+
+    auto tokens = tokenizer.tokenize("x = \"if\"");
+
+    ASSERT_EQ_STR(tokensStr(tokens), "4:4:1")
+}
+
+TEST_METHOD(tokenize_must_keep_multiline_state)
+{
+    Tokenizer tokenizer(makeSpec());
+
+    ASSERT_EQ_STR(tokensStr(tokenizer.tokenize("a /* b")), "2:4:2")
+    ASSERT_EQ_INT(tokenizer.state(), 2)
+    ASSERT_EQ_STR(tokensStr(tokenizer.tokenize("if")), "0:2:2")
+    ASSERT_EQ_STR(tokensStr(tokenizer.tokenize("c */ if")), "0:4:2 5:2:0")
+    ASSERT_EQ_INT(tokenizer.state(), -1)
+}
+
+TEST_METHOD(tokenize_must_match_terms_as_whole_words)
+{
+    Tokenizer tokenizer(makeSpec());
+
+    auto tokens = tokenizer.tokenize("If if_x elsewhere else");
+
+    ASSERT_EQ_STR(tokensStr(tokens), "18:4:0")
+}
+
+TEST_METHOD(tokenize_must_match_terms_ignoring_case)
+{
+    Tokenizer tokenizer(parseSpec(
+        "name: test\n"
+        "rule: Keyword\n"
+        "terms: select,from\n"
+        "opts: ignore-case\n"));
+
+    auto tokens = tokenizer.tokenize("SELECT x From y selected");
+
+    ASSERT_EQ_STR(tokensStr(tokens), "0:6:0 9:4:0")
+}
+
+TEST_METHOD(tokenize_must_prefer_later_rule_for_shared_term)
+{
+    Tokenizer tokenizer(parseSpec(
+        "name: test\n"
+        "rule: Exact\n"
+        "terms: foo\n"
+        "rule: Any case\n"
+        "terms: foo,bar\n"
+        "opts: ignore-case\n"));
+
+    auto tokens = tokenizer.tokenize("FOO foo Bar");
+
+    ASSERT_EQ_STR(tokensStr(tokens), "0:3:1 4:3:1 8:3:1")
+    ASSERT_EQ_INT(tokenizer.spec()->words.size(), 1)
+    ASSERT_EQ_INT(tokenizer.spec()->wordsNoCase.size(), 2)
+}
+
+TEST_METHOD(matchBlock_must_skip_only_matches_inside_skipped_ranges)
+{
+    auto spec = parseSpec(
+        "name: test\n"
+        "rule: String\n"
+        "expr: \"[^\"]*\"\n"
+        "rule: Keyword\n"
+        "terms: if\n"
+        "skip: String\n"
+        "rule: Number\n"
+        "expr: \\d+\n"
+        "skip: String\n");
+
+    // Matches after a longer string are not inside it, even though they are shorter
+    FormatRuns runs;
+    matchBlock(*spec, "\"a b c\" 12 if \"if 1\"", -1, runs);
+
+    ASSERT_EQ_STR(tokensStr(runs), "0:7:0 14:6:0 11:2:1 8:2:2")
+}
+
+TEST_METHOD(tokenize_must_match_not_plain_terms_as_expressions)
+{
+    Tokenizer tokenizer(parseSpec(
+        "name: test\n"
+        "rule: Keyword\n"
+        "terms: if,std::move\n"));
+
+    auto tokens = tokenizer.tokenize("std::move(x) if");
+
+    ASSERT_EQ_INT(tokenizer.spec()->rules.at(0).exprs.size(), 1)
+    ASSERT_EQ_STR(tokensStr(tokens), "0:9:0 13:2:0")
+}
+
+TEST_METHOD(scanner_must_see_whole_block_around_group)
+{
+    QString code(
+        "name: test\n"
+        "rule: Letter\n"
+        "expr: \\b[a-z]\\b\n"
+        "rule: Prefixed\n"
+        "expr: x([a-z]+)\n"
+        "group: 1\n"
+        "rule: Key\n"
+        "terms: rule\n"
+        "rule: Rule name\n"
+        "expr: ^rule:\\s*(.*)\n"
+        "group: 1\n");
+    Tokenizer byRules(parseSpec(code));
+    Tokenizer byScanner(parseSpec("engine: scanner\n" + code));
+    ASSERT_EQ_INT(byScanner.spec()->engine, Spec::ENGINE_SCANNER)
+
+    // The letter before the group is followed by a word char, so it's not a whole word
+    ASSERT_EQ_STR(tokensStr(byScanner.tokenize("ab xcd")), "4:2:1")
+    ASSERT_EQ_STR(tokensStr(byRules.tokenize("ab xcd")), "4:2:1")
+
+    // A shorter match of another rule is found before the group
+    ASSERT_EQ_STR(tokensStr(byScanner.tokenize("rule: Separator")), "0:4:2 6:9:3")
+    ASSERT_EQ_STR(tokensStr(byRules.tokenize("rule: Separator")), "0:4:2 6:9:3")
+
+    // Empty group doesn't make the same part to be scanned again and again
+    ASSERT_EQ_STR(tokensStr(byScanner.tokenize("rule:")), "0:4:2")
+    ASSERT_EQ_STR(tokensStr(byRules.tokenize("rule:")), "0:4:2")
+}
+
+TEST_METHOD(scanner_must_agree_with_rules_engine_on_syntax_samples)
+{
+    QDir dir(QFileInfo(__FILE__).absolutePath() + "/../syntax");
+    auto fileNames = dir.entryList({"*.ohl"}, QDir::Files);
+    ASSERT_IS_FALSE(fileNames.isEmpty())
+
+    int comparedLines = 0;
+    for (const auto& fileName : std::as_const(fileNames))
+    {
+        QFile file(dir.filePath(fileName));
+        ASSERT_IS_TRUE(file.open(QFile::ReadOnly | QFile::Text))
+        QString text = QTextStream(&file).readAll();
+        int sampleStart = text.indexOf("\n---");
+        ASSERT_IS_TRUE(sampleStart > 0)
+        QString code = text.left(sampleStart);
+        QString sample = text.mid(text.indexOf('\n', sampleStart + 1) + 1);
+
+        Tokenizer byRules(parseSpec(code));
+        Tokenizer byScanner(parseSpec("engine: scanner\n" + code));
+        ASSERT_EQ_INT(byScanner.spec()->engine, Spec::ENGINE_SCANNER)
+
+        for (const auto& line : sample.split('\n'))
+        {
+            FormatRuns runs;
+            matchBlock(*byRules.spec(), line, byRules.state(), runs);
+            bool comparable = byRules.state() == byScanner.state() && !hasOverlaps(runs);
+            auto expected = tokensStr(byRules.tokenize(line));
+            auto actual = tokensStr(byScanner.tokenize(line));
+            if (!comparable)
+                continue;
+            if (actual != expected || byScanner.state() != byRules.state())
+                ASSERT_FAIL(QString("%1: line \"%2\"\nrules: %3\nscanner: %4").arg(fileName, line, expected, actual))
+            comparedLines++;
+        }
+    }
+    TEST_LOG_VALUE(comparedLines)
+    ASSERT_IS_TRUE(comparedLines > 0)
+}
+
+TEST_METHOD(file_storage_must_read_back_compiled_spec)
+{
+    QStandardPaths::setTestModeEnabled(true);
+    QTemporaryDir dir;
+    ASSERT_IS_TRUE(dir.isValid())
+    QString code =
+        "name: test\n"
+        "engine: scanner\n"
+        "\n"
+        "rule: Keyword\n"
+        "terms: if,else,a-b\n"
+        "opts: ignore-case\n"
+        "color: #0000ff\n"
+        "\n"
+        "rule: String\n"
+        "expr: \"[^\"]*\"\n"
+        "color: #ff0000\n";
+    Meta meta;
+    meta.source = dir.filePath("test.phl");
+    auto writeSource = [&meta](const QString& code) {
+        QFile file(meta.source);
+        file.open(QFile::WriteOnly | QFile::Truncate);
+        file.write(code.toUtf8());
+    };
+    writeSource(code);
+    auto sourceTime = QFileInfo(meta.source).lastModified();
+
+    FileStorage storage(dir.path());
+    auto parsed = storage.loadSpec(meta);
+    ASSERT_IS_NOT_NULL(parsed.get())
+    auto compiledFile = FileStorage::compiledSpecFileName(meta.source);
+    ASSERT_IS_TRUE(QFile::exists(compiledFile))
+    ASSERT_IS_FALSE(compiledFile.startsWith(dir.path()))
+
+    // The same size and time of the source, so the compiled spec is still taken as valid
+    // and rule colors show that the spec is read back from it and not parsed again
+    writeSource(QString(code).replace("#0000ff", "#00ff00"));
+    QFile source(meta.source);
+    source.open(QFile::ReadWrite);
+    source.setFileTime(sourceTime, QFileDevice::FileModificationTime);
+    source.close();
+
+    auto compiled = storage.loadSpec(meta);
+    ASSERT_IS_NOT_NULL(compiled.get())
+    ASSERT_EQ_STR(compiled->meta.name, parsed->meta.name)
+    ASSERT_EQ_INT(compiled->engine, Spec::ENGINE_SCANNER)
+    ASSERT_EQ_INT(compiled->rules.size(), parsed->rules.size())
+    for (int i = 0; i < parsed->rules.size(); i++)
+    {
+        const auto& r1 = parsed->rules.at(i);
+        const auto& r2 = compiled->rules.at(i);
+        ASSERT_EQ_STR(r2.name, r1.name)
+        ASSERT_EQ_STR(r2.terms.join(','), r1.terms.join(','))
+        ASSERT_EQ_INT(r2.exprs.size(), r1.exprs.size())
+        ASSERT_EQ_STR(r2.format.foreground().color().name(), r1.format.foreground().color().name())
+    }
+    ASSERT_EQ_STR(compiled->rules.at(0).format.foreground().color().name(), "#0000ff")
+    ASSERT_EQ_INT(compiled->wordsNoCase.size(), parsed->wordsNoCase.size())
+    ASSERT_EQ_STR(compiled->scanner.expr.pattern(), parsed->scanner.expr.pattern())
+    ASSERT_EQ_INT(compiled->scanner.alts.size(), parsed->scanner.alts.size())
+
+    QString line = "If x = \"else\" A-B else";
+    Tokenizer byParsed(parsed);
+    Tokenizer byCompiled(compiled);
+    ASSERT_EQ_STR(tokensStr(byCompiled.tokenize(line)), tokensStr(byParsed.tokenize(line)))
+
+    QFile::remove(compiledFile);
+}
+
+TEST_METHOD(matchBlockState_must_agree_with_matchBlock)
+{
+    QString code = makeDeferredSpecCode();
+    auto lines = makeDeferredText(1).split('\n');
+    for (const auto& spec : {parseSpec(code), parseSpec("engine: scanner\n" + code)})
+    {
+        int state = -1;
+        for (const auto& line : std::as_const(lines))
+        {
+            FormatRuns runs;
+            int expected = matchBlock(*spec, line, state, runs);
+            int actual = matchBlockState(*spec, line, state);
+            if (actual != expected)
+                ASSERT_FAIL(QString("engine %1: line \"%2\" expected state %3, got %4")
+                    .arg(spec->engine).arg(line).arg(expected).arg(actual))
+            state = expected;
+        }
+    }
+}
+
+TEST_METHOD(deferred_highlighter_must_format_as_immediate)
+{
+    QString code = makeDeferredSpecCode();
+    QString text = makeDeferredText(200);
+    for (const auto& spec : {parseSpec(code), parseSpec("engine: scanner\n" + code)})
+    {
+        QTextDocument expected;
+        expected.documentLayout();
+        expected.setPlainText(text);
+        Highlighter immediate(&expected, spec);
+        immediate.rehighlight();
+
+        QTextDocument actual;
+        actual.documentLayout();
+        actual.setPlainText(text);
+        Highlighter deferred(&actual, spec);
+        deferred.setDeferred(true);
+        ASSERT_IS_TRUE(waitDeferredFinished(deferred))
+        ASSERT_EQ_INT(compareFormats(expected, actual), -1)
+
+        // Edits renumber pending blocks, then they must be highlighted as in the immediate mode
+        for (auto doc : {&expected, &actual})
+        {
+            QTextCursor cursor(doc->findBlockByNumber(10));
+            cursor.insertText("/* new\ncomment\n");
+            cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor, 3);
+            cursor.removeSelectedText();
+        }
+        ASSERT_IS_TRUE(waitDeferredFinished(deferred))
+        ASSERT_EQ_INT(compareFormats(expected, actual), -1)
+    }
+}
+
+TEST_METHOD(threaded_highlighter_must_drop_results_of_cancelled_jobs)
+{
+    auto spec = parseSpec("engine: scanner\n" + makeDeferredSpecCode());
+    QString text = makeDeferredText(2000);
+
+    QTextDocument actual;
+    actual.documentLayout();
+    actual.setPlainText(text);
+    Highlighter threaded(&actual, spec);
+    threaded.setThreaded(true);
+
+    // Documents are edited while jobs are running or their results are waiting for delivery,
+    // so results of cancelled jobs are numbered in the old way and must not be applied
+    QEventLoop loop;
+    int edits = 0;
+    QTimer editTimer;
+    editTimer.setInterval(30);
+    QObject::connect(&editTimer, &QTimer::timeout, &loop, [&]{
+        QTextCursor cursor(actual.findBlockByNumber(edits * 7));
+        cursor.insertText(edits % 2 ? "/* opened\n" : "x */ closed\n");
+        if (++edits == 10)
+            loop.quit();
+    });
+    editTimer.start();
+    loop.exec();
+    editTimer.stop();
+    ASSERT_IS_TRUE(waitDeferredFinished(threaded))
+
+    QTextDocument expected;
+    expected.documentLayout();
+    expected.setPlainText(actual.toPlainText());
+    Highlighter immediate(&expected, spec);
+    immediate.rehighlight();
+    ASSERT_EQ_INT(compareFormats(expected, actual), -1)
+}
+
+TEST_METHOD(toHtml_must_escape_text)
+{
+    auto html = toHtml(makeSpec(), "a<b\n\"&\"");
+
+    ASSERT_EQ_STR(html, "a&lt;b\n<span style=\"color:#ff0000\">&quot;&amp;&quot;</span>")
+}
+
+TEST_METHOD(toHtml_must_apply_font_size_delta)
+{
+    QSharedPointer<Spec> spec(new Spec(*makeSpec()));
+    spec->rules[0].fontSizeDelta = 2;
+    spec->rules[1].fontSizeDelta = -1;
+
+    auto html = toHtml(spec, "if \"s\"");
+
+    ASSERT_EQ_STR(html, "<span style=\"color:#0000ff;font-size:calc(1em + 2pt)\">if</span> "
+                        "<span style=\"color:#ff0000;font-size:calc(1em - 1pt)\">&quot;s&quot;</span>")
+}
+
+//------------------------------------------------------------------------------
+
+TEST_GROUP("Highlighter",
+    ADD_TEST(tokenize_must_find_terms),
+    ADD_TEST(tokenize_must_prefer_later_rule),
+    ADD_TEST(tokenize_must_keep_multiline_state),
+    ADD_TEST(tokenize_must_match_terms_as_whole_words),
+    ADD_TEST(tokenize_must_match_terms_ignoring_case),
+    ADD_TEST(tokenize_must_prefer_later_rule_for_shared_term),
+    ADD_TEST(matchBlock_must_skip_only_matches_inside_skipped_ranges),
+    ADD_TEST(tokenize_must_match_not_plain_terms_as_expressions),
+    ADD_TEST(scanner_must_see_whole_block_around_group),
+    ADD_TEST(scanner_must_agree_with_rules_engine_on_syntax_samples),
+    ADD_TEST(file_storage_must_read_back_compiled_spec),
+    ADD_TEST(matchBlockState_must_agree_with_matchBlock),
+    ADD_GUI_TEST(deferred_highlighter_must_format_as_immediate),
+    ADD_GUI_TEST(threaded_highlighter_must_drop_results_of_cancelled_jobs),
+    ADD_TEST(toHtml_must_escape_text),
+    ADD_TEST(toHtml_must_apply_font_size_delta),
+)
+
+} // namespace HighlighterTests
+} // namespace Tests
+} // namespace Ori
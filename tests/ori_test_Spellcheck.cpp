@@ -0,0 +1,57 @@
+#include "../testing/OriTestBase.h"
+#include "../tools/OriSpellcheckWords.h"
+
+namespace Ori {
+namespace Tests {
+namespace SpellcheckTests {
+
+static QString wordsStr(const SpellcheckBlock& block)
+{
+    QStringList s;
+    scanWords(block, [&s](int pos, int length, const QString& word){
+        s << QString("%1:%2").arg(pos).arg(word);
+        if (word.size() != length)
+            s << "invalid length";
+    });
+    return s.join(' ');
+}
+
+//------------------------------------------------------------------------------
+
+TEST_METHOD(scanWords_must_keep_apostrophes_between_letters)
+{
+    ASSERT_EQ_STR(wordsStr({0, "It doesn't work, 'quoted' dogs' bone", {}}),
+                  "0:It 3:doesn't 11:work 18:quoted 26:dogs 32:bone")
+
+    // Typographic apostrophe U+2019 is the same
+    ASSERT_EQ_STR(wordsStr({10, QString::fromUtf8("It doesn’t work ’n’ rock’"), {}}),
+                  QString::fromUtf8("10:It 13:doesn’t 21:work 30:rock"))
+}
+
+TEST_METHOD(scanWords_must_skip_one_letter_words)
+{
+    ASSERT_EQ_STR(wordsStr({0, "a I e.g. x1 2nd", {}}), "9:x1 12:2nd")
+}
+
+TEST_METHOD(scanWords_must_skip_words_in_hyperlinks)
+{
+    const QString text("see http://example.com/page here and there");
+    const int start = text.indexOf("http");
+    const int stop = text.indexOf(" here");
+    ASSERT_EQ_STR(wordsStr({0, text, {{start, stop}}}), "0:see 28:here 33:and 37:there")
+
+    // Words partially covered by hyperlinks are skipped too
+    ASSERT_EQ_STR(wordsStr({100, "prefix_word link text, after", {{3, 9}, {12, 16}}}), "117:text 123:after")
+}
+
+//------------------------------------------------------------------------------
+
+TEST_GROUP("Spellcheck",
+    ADD_TEST(scanWords_must_keep_apostrophes_between_letters),
+    ADD_TEST(scanWords_must_skip_one_letter_words),
+    ADD_TEST(scanWords_must_skip_words_in_hyperlinks),
+)
+
+} // namespace SpellcheckTests
+} // namespace Tests
+} // namespace Ori
@@ -10,12 +10,26 @@ USE_GROUP(MathTests)        // ori_test_math.cpp
 USE_GROUP(TemplatesTests)   // ori_test_Templates.cpp
 USE_GROUP(VersionTests)     // ori_test_Version.cpp
 USE_GROUP(FilterTests)      // ori_test_Filter.cpp
+USE_GROUP(HighlighterTests) // ori_test_Highlighter.cpp
+USE_GROUP(CodeEditorTests)  // ori_test_CodeEditor.cpp
+USE_GROUP(CodeSearchTests)  // ori_test_CodeSearch.cpp
+#ifdef ORI_USE_SPELLCHECK
+USE_GROUP(SpellcheckTests)  // ori_test_Spellcheck.cpp
+// Directives can't be put into arguments of the macros below
+#define ORI_SPELLCHECK_TESTS ADD_GROUP(SpellcheckTests),
+#else
+#define ORI_SPELLCHECK_TESTS
+#endif
 
 TEST_SUITE(
     ADD_GROUP(MathTests),
     ADD_GROUP(TemplatesTests),
     ADD_GROUP(VersionTests),
     ADD_GROUP(FilterTests),
+    ADD_GROUP(HighlighterTests),
+    ADD_GROUP(CodeEditorTests),
+    ADD_GROUP(CodeSearchTests),
+    ORI_SPELLCHECK_TESTS
 )
 
 namespace All {
@@ -24,6 +38,10 @@ namespace All {
         ADD_GROUP(TemplatesTests),
         ADD_GROUP(VersionTests),
         ADD_GROUP(FilterTests),
+        ADD_GROUP(HighlighterTests),
+        ADD_GROUP(CodeEditorTests),
+        ADD_GROUP(CodeSearchTests),
+        ORI_SPELLCHECK_TESTS
     )
 }
 
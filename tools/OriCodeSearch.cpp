@@ -0,0 +1,356 @@
+#include "OriCodeSearch.h"
+
+#include "tools/OriExtraSelections.h"
+#include "tools/OriWorkerLink.h"
+
+#include <QElapsedTimer>
+#include <QPlainTextEdit>
+#include <QRegularExpression>
+#include <QRunnable>
+#include <QStringMatcher>
+#include <QThreadPool>
+
+namespace Ori {
+
+namespace {
+
+QRegularExpression makeExpression(const QString& pattern, CodeSearch::Options options)
+{
+    QRegularExpression::PatternOptions opts = QRegularExpression::MultilineOption;
+    if (!options.testFlag(CodeSearch::CaseSensitive))
+        opts |= QRegularExpression::CaseInsensitiveOption;
+    // Word boundaries must agree with `isWordChar()` used for literal patterns,
+    // while `\b` only knows ASCII word characters without this option
+    if (options.testFlag(CodeSearch::WholeWords))
+        return QRegularExpression("\\b(?:" + pattern + ")\\b", opts | QRegularExpression::UseUnicodePropertiesOption);
+    return QRegularExpression(pattern, opts);
+}
+
+inline bool isWordChar(const QChar& c)
+{
+    return c.isLetterOrNumber() || c == '_';
+}
+
+QString expandCaptures(const QString& replacement, const QRegularExpressionMatch& match)
+{
+    QString result;
+    result.reserve(replacement.size());
+    for (int i = 0; i < replacement.size(); i++)
+    {
+        QChar c = replacement.at(i);
+        if (c == '\\' && i+1 < replacement.size())
+        {
+            QChar next = replacement.at(i+1);
+            if (next.isDigit())
+            {
+                result += match.captured(next.digitValue());
+                i++;
+                continue;
+            }
+            if (next == '\\')
+            {
+                result += next;
+                i++;
+                continue;
+            }
+        }
+        result += c;
+    }
+    return result;
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+//                               SearchJob
+//------------------------------------------------------------------------------
+
+struct SearchLink : WorkerLink<SearchHits, bool, bool> {};
+
+// Searches in a snapshot of the document text, runs in a worker thread
+class SearchJob : public QRunnable
+{
+public:
+    QString text;
+    QString pattern;
+    CodeSearch::Options options;
+    int startPos = 0;
+    QSharedPointer<SearchLink> link;
+
+    void run() override
+    {
+        if (options.testFlag(CodeSearch::Regex))
+            _expr = makeExpression(pattern, options);
+        else
+            _matcher.setPattern(pattern);
+        _matcher.setCaseSensitivity(options.testFlag(CodeSearch::CaseSensitive) ? Qt::CaseSensitive : Qt::CaseInsensitive);
+        _timer.start();
+
+        // Hits in the visible area go first
+        if (!searchRange(startPos, text.size(), false))
+            return;
+        if (startPos > 0 && !searchRange(0, startPos, true))
+            return;
+        deliver(true, true, true);
+    }
+
+private:
+    static const int BATCH_SIZE = 1000;
+    static const int BATCH_MSECS = 50;
+
+    QRegularExpression _expr;
+    QStringMatcher _matcher;
+    QElapsedTimer _timer;
+    SearchHits _batch;
+
+    SearchHit findNext(int pos) const
+    {
+        if (options.testFlag(CodeSearch::Regex))
+        {
+            auto match = _expr.match(text, pos);
+            if (!match.hasMatch())
+                return {-1, 0};
+            return {int(match.capturedStart()), int(match.capturedLength())};
+        }
+        const int length = pattern.size();
+        while (true)
+        {
+            int start = _matcher.indexIn(text, pos);
+            if (start < 0 || !options.testFlag(CodeSearch::WholeWords))
+                return {start, length};
+            int end = start + length;
+            if ((start == 0 || !isWordChar(text.at(start-1))) &&
+                (end == text.size() || !isWordChar(text.at(end))))
+                return {start, length};
+            pos = start + 1;
+        }
+    }
+
+    /// Finds hits starting in the range [from, to)
+    bool searchRange(int from, int to, bool wrapped)
+    {
+        int pos = from;
+        int count = 0;
+        while (pos < to)
+        {
+            SearchHit hit = findNext(pos);
+            if (hit.pos < 0 || hit.pos >= to)
+                break;
+            _batch << hit;
+            pos = hit.pos + qMax(1, hit.length);
+            if (_batch.size() >= BATCH_SIZE || (++count & 0xFF) == 0)
+                if (!deliver(wrapped, false))
+                    return false;
+        }
+        return deliver(wrapped, true);
+    }
+
+    bool deliver(bool wrapped, bool force, bool done = false)
+    {
+        // Small batches are collected until it takes too long
+        if (!force && _batch.size() < BATCH_SIZE && _timer.elapsed() < BATCH_MSECS)
+            return !link->isCancelled();
+        if (_batch.isEmpty() && !done)
+            return !link->isCancelled();
+        if (!link->deliver(_batch, wrapped, done))
+            return false;
+        _batch.clear();
+        _timer.restart();
+        return true;
+    }
+};
+
+//------------------------------------------------------------------------------
+//                               CodeSearch
+//------------------------------------------------------------------------------
+
+CodeSearch::CodeSearch(QPlainTextEdit* editor) : QObject(editor), _editor(editor), _edits(editor->document())
+{
+    connect(_editor->document(), &QTextDocument::contentsChange, this, &CodeSearch::documentChanged);
+}
+
+CodeSearch::~CodeSearch()
+{
+    cancel();
+}
+
+bool CodeSearch::findAll(const QString& pattern, Options options)
+{
+    cancel();
+    _hits.clear();
+    _wrappedHits.clear();
+    _snapshot.clear();
+    updateHighlight({}, true);
+
+    if (pattern.isEmpty())
+        return false;
+    if (options.testFlag(Regex) && !makeExpression(pattern, options).isValid())
+        return false;
+
+    _pattern = pattern;
+    _options = options;
+    _snapshot = _editor->toPlainText();
+    _edits.reset();
+
+    QSharedPointer<SearchLink> link(new SearchLink);
+    link->post = [this, l = link.data()](const SearchHits& hits, bool wrapped, bool done){
+        QMetaObject::invokeMethod(this, [this, l, hits, wrapped, done]{
+            if (_link.data() != l)
+                return;
+            if (wrapped)
+                _wrappedHits << hits;
+            else
+                _hits << hits;
+            int total = _hits.size() + _wrappedHits.size();
+            if (!hits.isEmpty())
+            {
+                updateHighlight(hits, false);
+                emit hitsFound(hits, total);
+            }
+            if (done)
+            {
+                // Wrapped hits precede all the others
+                if (!_wrappedHits.isEmpty())
+                {
+                    _wrappedHits << _hits;
+                    _hits.swap(_wrappedHits);
+                    _wrappedHits.clear();
+                }
+                _link.reset();
+                emit finished(total);
+            }
+        }, Qt::QueuedConnection);
+    };
+    _link = link;
+
+    auto job = new SearchJob;
+    job->text = _snapshot;
+    job->pattern = pattern;
+    job->options = options;
+    job->startPos = _editor->cursorForPosition(QPoint(0, 0)).block().position();
+    job->link = link;
+    QThreadPool::globalInstance()->start(job);
+    return true;
+}
+
+void CodeSearch::cancel()
+{
+    if (!_link) return;
+    _link->cancel();
+    _link.reset();
+}
+
+void CodeSearch::setHighlightHits(bool on)
+{
+    if (_highlightHits == on) return;
+    if (on)
+    {
+        _highlightHits = true;
+        updateHighlight(_hits + _wrappedHits, true);
+    }
+    else
+    {
+        updateHighlight({}, true);
+        _highlightHits = false;
+    }
+}
+
+void CodeSearch::updateHighlight(const SearchHits& hits, bool reset)
+{
+    if (!_highlightHits) return;
+
+    if (reset)
+        _marks.clear();
+    _marks.reserve(_marks.size() + hits.size());
+
+    QTextEdit::ExtraSelection mark;
+    mark.format.setBackground(QColor(0xffffe680));
+    mark.cursor = QTextCursor(_editor->document());
+    for (const auto& hit : hits)
+    {
+        mark.cursor.setPosition(hit.pos);
+        mark.cursor.setPosition(hit.pos + hit.length, QTextCursor::KeepAnchor);
+        _marks << mark;
+    }
+
+    // Batches come much more often than the editor is repainted,
+    // so the layer gets the accumulated marks once per event loop turn
+    if (_marksScheduled) return;
+    _marksScheduled = true;
+    QMetaObject::invokeMethod(this, &CodeSearch::flushHighlight, Qt::QueuedConnection);
+}
+
+void CodeSearch::flushHighlight()
+{
+    if (!_marksScheduled) return;
+    _marksScheduled = false;
+
+    if (!_layers)
+        _layers = ExtraSelections::of(_editor);
+    _layers->setLayer(ExtraSelections::LAYER_SEARCH, _marks);
+}
+
+void CodeSearch::documentChanged(int position, int charsRemoved, int charsAdded)
+{
+    Q_UNUSED(position)
+
+    if (_changesLocked) return;
+    if (!_link && _hits.isEmpty()) return;
+
+    if (!_edits.changed(charsRemoved, charsAdded))
+        return;
+
+    cancel();
+    _hits.clear();
+    _wrappedHits.clear();
+    _snapshot.clear();
+    updateHighlight({}, true);
+    emit invalidated();
+}
+
+int CodeSearch::replaceAll(const QString& replacement)
+{
+    if (isRunning() || _hits.isEmpty()) return 0;
+
+    const bool regex = _options.testFlag(Regex);
+    QRegularExpression expr;
+    if (regex)
+        expr = makeExpression(_pattern, _options);
+
+    int count = 0;
+    int prevStart = _snapshot.size() + 1;
+    QTextCursor cursor(_editor->document());
+    _changesLocked = true;
+    cursor.beginEditBlock();
+    // Going from the end keeps positions of preceding hits valid
+    for (int i = _hits.size()-1; i >= 0; i--)
+    {
+        const auto& hit = _hits.at(i);
+        // Hits found before and after the wrap point can overlap
+        if (hit.pos + hit.length > prevStart)
+            continue;
+        QString text = replacement;
+        if (regex)
+        {
+            auto match = expr.match(_snapshot, hit.pos);
+            if (!match.hasMatch() || match.capturedStart() != hit.pos)
+                continue;
+            text = expandCaptures(replacement, match);
+        }
+        cursor.setPosition(hit.pos);
+        cursor.setPosition(hit.pos + hit.length, QTextCursor::KeepAnchor);
+        cursor.insertText(text);
+        prevStart = hit.pos;
+        count++;
+    }
+    cursor.endEditBlock();
+    _changesLocked = false;
+
+    _hits.clear();
+    _snapshot.clear();
+    updateHighlight({}, true);
+    emit invalidated();
+    return count;
+}
+
+} // namespace Ori
@@ -0,0 +1,108 @@
+#ifndef ORI_CODE_SEARCH_H
+#define ORI_CODE_SEARCH_H
+
+#include <QObject>
+#include <QSharedPointer>
+#include <QTextEdit>
+#include <QVector>
+
+#include "OriTextEdits.h"
+
+QT_BEGIN_NAMESPACE
+class QPlainTextEdit;
+QT_END_NAMESPACE
+
+/**
+
+Finds all occurrences of a literal string or a regular expression in a text editor.
+
+Searching is done in a worker thread over a snapshot of the document text,
+so it doesn't block the editor even in large files. Hits are reported in batches
+as they are found, starting from the top of the visible area, then the search goes
+to the document end and wraps around to its beginning.
+
+When the document is changed, a running search is cancelled and found hits become invalid,
+then `invalidated()` is emitted and the search should be restarted if its results are still needed.
+
+*/
+
+namespace Ori {
+
+struct SearchHit
+{
+    int pos;
+    int length;
+};
+
+using SearchHits = QVector<SearchHit>;
+
+struct SearchLink;
+class ExtraSelections;
+
+class CodeSearch : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Option
+    {
+        Regex = 0x01,
+        CaseSensitive = 0x02,
+        WholeWords = 0x04,
+    };
+    Q_DECLARE_FLAGS(Options, Option)
+
+    explicit CodeSearch(QPlainTextEdit* editor);
+    ~CodeSearch();
+
+    /// Starts a new search cancelling the running one.
+    /// Returns false if the pattern is empty or is not a valid regular expression.
+    bool findAll(const QString& pattern, Options options = {});
+    void cancel();
+
+    bool isRunning() const { return bool(_link); }
+
+    /// Hits are ordered by position when the search is finished.
+    /// While it's running, hits are ordered the same way as they were found.
+    const SearchHits& hits() const { return _hits; }
+
+    /// Hits are marked in the editor with the search layer of `ExtraSelections`
+    bool highlightHits() const { return _highlightHits; }
+    void setHighlightHits(bool on);
+
+    /// Replaces all hits of the finished search in a single undo step. For regular expressions,
+    /// the replacement can refer to captured groups as `\1` ... `\9`, and `\0` is the whole match.
+    /// Returns the number of replaced hits.
+    int replaceAll(const QString& replacement);
+
+signals:
+    /// Reports the next batch of found hits and the number of hits found so far
+    void hitsFound(const Ori::SearchHits& hits, int total);
+    void finished(int total);
+    void invalidated();
+
+private:
+    QPlainTextEdit* _editor;
+    QSharedPointer<SearchLink> _link;
+    QString _pattern;
+    Options _options;
+    QString _snapshot;
+    SearchHits _hits;
+    SearchHits _wrappedHits;
+    bool _highlightHits = true;
+    TextEdits _edits;
+    bool _changesLocked = false;
+    ExtraSelections* _layers = nullptr;
+    QList<QTextEdit::ExtraSelection> _marks;
+    bool _marksScheduled = false;
+
+    void documentChanged(int position, int charsRemoved, int charsAdded);
+    void updateHighlight(const SearchHits& hits, bool reset);
+    void flushHighlight();
+};
+
+} // namespace Ori
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(Ori::CodeSearch::Options)
+
+#endif // ORI_CODE_SEARCH_H
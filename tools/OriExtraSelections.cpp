@@ -0,0 +1,81 @@
+#include "OriExtraSelections.h"
+
+#include <QDebug>
+#include <QPlainTextEdit>
+
+namespace Ori {
+
+ExtraSelections::ExtraSelections(QWidget* editor) : QObject(editor), _editor(editor)
+{
+}
+
+ExtraSelections* ExtraSelections::of(QTextEdit* editor)
+{
+    auto layers = editor->findChild<ExtraSelections*>(QString(), Qt::FindDirectChildrenOnly);
+    return layers ? layers : new ExtraSelections(editor);
+}
+
+ExtraSelections* ExtraSelections::of(QPlainTextEdit* editor)
+{
+    auto layers = editor->findChild<ExtraSelections*>(QString(), Qt::FindDirectChildrenOnly);
+    return layers ? layers : new ExtraSelections(editor);
+}
+
+const ExtraSelections::Selections& ExtraSelections::layer(int layer) const
+{
+    static const Selections empty;
+    auto it = _layers.constFind(layer);
+    return it == _layers.constEnd() ? empty : it.value();
+}
+
+void ExtraSelections::setLayer(int layer, const Selections& selections)
+{
+    if (selections.isEmpty())
+    {
+        clearLayer(layer);
+        return;
+    }
+    _layers[layer] = selections;
+    scheduleFlush();
+}
+
+void ExtraSelections::clearLayer(int layer)
+{
+    if (_layers.remove(layer) > 0)
+        scheduleFlush();
+}
+
+void ExtraSelections::scheduleFlush()
+{
+    if (_flushScheduled) return;
+    _flushScheduled = true;
+    QMetaObject::invokeMethod(this, &ExtraSelections::flush, Qt::QueuedConnection);
+}
+
+void ExtraSelections::flush()
+{
+    if (!_flushScheduled) return;
+    _flushScheduled = false;
+
+    Selections merged;
+    if (_layers.size() == 1)
+        merged = _layers.first();
+    else
+    {
+        int count = 0;
+        for (auto it = _layers.constBegin(); it != _layers.constEnd(); it++)
+            count += it.value().size();
+        merged.reserve(count);
+        for (auto it = _layers.constBegin(); it != _layers.constEnd(); it++)
+            merged.append(it.value());
+    }
+
+    if (auto editor = qobject_cast<QTextEdit*>(_editor); editor)
+        editor->setExtraSelections(merged);
+    else if (auto editor = qobject_cast<QPlainTextEdit*>(_editor); editor)
+        editor->setExtraSelections(merged);
+    else
+        qWarning() << Q_FUNC_INFO << "Unsupported editor type";
+}
+
+} // namespace Ori
@@ -0,0 +1,63 @@
+#ifndef ORI_EXTRA_SELECTIONS_H
+#define ORI_EXTRA_SELECTIONS_H
+
+#include <QMap>
+#include <QTextEdit>
+
+QT_BEGIN_NAMESPACE
+class QPlainTextEdit;
+QT_END_NAMESPACE
+
+namespace Ori {
+
+/**
+
+Keeps extra selections of a text editor in separate layers, so several features
+can mark text in the same editor without overwriting marks of each other.
+
+A feature replaces only its own layer, and the editor gets the merged list of all layers
+once per event loop turn, however many layers have been changed in the meantime.
+Layers are merged in ascending order, so selections of higher layers are drawn on top.
+
+*/
+class ExtraSelections : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Layer
+    {
+        LAYER_SEARCH = 10,
+        LAYER_SPELLING = 20,
+        LAYER_DIAGNOSTICS = 30,
+        /// Custom layers can be numbered starting from this one
+        LAYER_USER = 100,
+    };
+
+    using Selections = QList<QTextEdit::ExtraSelection>;
+
+    /// Returns selection layers of the editor, they are created on the first call.
+    /// The editor should not get extra selections directly after that.
+    static ExtraSelections* of(QTextEdit* editor);
+    static ExtraSelections* of(QPlainTextEdit* editor);
+
+    const Selections& layer(int layer) const;
+    void setLayer(int layer, const Selections& selections);
+    void clearLayer(int layer);
+
+    /// Pushes merged layers to the editor immediately if any of them has been changed
+    void flush();
+
+private:
+    explicit ExtraSelections(QWidget* editor);
+
+    QWidget* _editor;
+    QMap<int, Selections> _layers;
+    bool _flushScheduled = false;
+
+    void scheduleFlush();
+};
+
+} // namespace Ori
+
+#endif // ORI_EXTRA_SELECTIONS_H
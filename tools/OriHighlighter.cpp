@@ -1,10 +1,26 @@
 #include "OriHighlighter.h"
 
+#include "OriWorkerLink.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QFileInfo>
+#include <QMutex>
 #include <QPlainTextEdit>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
 #include <QTextDocument>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <algorithm>
+#include <functional>
 
 /**
 
@@ -28,6 +44,121 @@ QString Spec::storableString() const
     return rawCode().trimmed() + "\n\n---\n" + rawSample().trimmed();
 }
 
+//------------------------------------------------------------------------------
+//                                  Words
+//------------------------------------------------------------------------------
+
+// Ranges matched by a rule in a block. They are sorted by start when first queried
+// after additions, and ends are accumulated as a running maximum, so checking
+// if a range is contained in any of matched ranges is a binary search.
+class RangeIndex
+{
+public:
+    void add(int pos, int length)
+    {
+        _ranges << qMakePair(pos, pos + length);
+        _sorted = false;
+    }
+
+    bool contains(int pos, int length)
+    {
+        if (_ranges.isEmpty())
+            return false;
+        if (!_sorted)
+            sort();
+        auto it = std::upper_bound(_ranges.cbegin(), _ranges.cend(), pos,
+            [](int p, const QPair<int, int>& r){ return p < r.first; });
+        if (it == _ranges.cbegin())
+            return false;
+        return _maxEnds.at(int(it - _ranges.cbegin()) - 1) >= pos + length;
+    }
+
+    /// Pairs of (start, end)
+    const QVector<QPair<int, int>>& ranges() const { return _ranges; }
+
+private:
+    QVector<QPair<int, int>> _ranges;
+    QVector<int> _maxEnds;
+    bool _sorted = true;
+
+    void sort()
+    {
+        std::sort(_ranges.begin(), _ranges.end());
+        _maxEnds.resize(_ranges.size());
+        int maxEnd = -1;
+        for (int i = 0; i < _ranges.size(); i++)
+        {
+            maxEnd = qMax(maxEnd, _ranges.at(i).second);
+            _maxEnds[i] = maxEnd;
+        }
+        _sorted = true;
+    }
+};
+
+using MatchedRanges = QVector<RangeIndex>;
+
+// The same set of chars as \w of QRegularExpression without UseUnicodePropertiesOption
+static inline bool isWordChar(QChar c)
+{
+    auto u = c.unicode();
+    return (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') || (u >= '0' && u <= '9') || u == '_';
+}
+
+static bool isPlainWord(const QString& term)
+{
+    if (term.isEmpty())
+        return false;
+    for (const auto& c : term)
+        if (!isWordChar(c))
+            return false;
+    return true;
+}
+
+static void addWord(QHash<QString, QVector<int>>& words, const QString& word, int ruleIndex)
+{
+    auto& indexes = words[word];
+    if (indexes.isEmpty() || indexes.last() != ruleIndex)
+        indexes << ruleIndex;
+}
+
+// A term is matched via expression `\bterm\b`, so for a plain word term it's the same
+// as to compare it with each maximal run of word chars, what is done here in one pass
+static void matchWords(const Spec& spec, const QString& text, MatchedRanges& matches)
+{
+    const bool noCase = !spec.wordsNoCase.isEmpty();
+    const int len = text.length();
+    QString lower;
+    int i = 0;
+    while (i < len)
+    {
+        if (!isWordChar(text.at(i)))
+        {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < len && isWordChar(text.at(i))) i++;
+        int length = i - start;
+
+        auto word = QString::fromRawData(text.constData() + start, length);
+        auto it = spec.words.constFind(word);
+        if (it != spec.words.constEnd())
+            for (int ruleIndex : it.value())
+                matches[ruleIndex].add(start, length);
+
+        if (noCase)
+        {
+            lower.resize(length);
+            for (int j = 0; j < length; j++)
+                lower[j] = word.at(j).toLower();
+            it = spec.wordsNoCase.constFind(lower);
+            if (it != spec.wordsNoCase.constEnd())
+                for (int ruleIndex : it.value())
+                    matches[ruleIndex].add(start, length);
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 //                                 SpecLoader
 //------------------------------------------------------------------------------
@@ -44,6 +175,7 @@ private:
     bool withRawData = false;
     QMap<int, QString> warnings;
     QMap<QString, int> ruleStarts;
+    int engineLineNo = 0;
 
     void warning(const QString& msg, int overrideLineNo = 0)
     {
@@ -92,9 +224,22 @@ private:
     {
         if (!rule.terms.isEmpty())
         {
+            const int ruleIndex = spec->rules.size();
+            const bool ignoreCase = opts.testFlag(QRegularExpression::CaseInsensitiveOption);
             rule.exprs.clear();
             foreach (const auto& term, rule.terms)
-                rule.exprs << QRegularExpression(QString("\\b%1\\b").arg(term));
+            {
+                // Multiline rules need terms as expressions for begin and end markers
+                if (!rule.multiline && isPlainWord(term))
+                {
+                    if (ignoreCase)
+                        addWord(spec->wordsNoCase, term.toLower(), ruleIndex);
+                    else
+                        addWord(spec->words, term, ruleIndex);
+                }
+                else
+                    rule.exprs << QRegularExpression(QString("\\b%1\\b").arg(term));
+            }
         }
         if (rule.multiline)
         {
@@ -127,6 +272,93 @@ private:
         spec->rules << rule;
     }
 
+    void buildScanner(Spec* spec)
+    {
+        const int ruleCount = spec->rules.size();
+
+        QVector<QStringList> words(ruleCount), wordsNoCase(ruleCount);
+        for (auto it = spec->words.constBegin(); it != spec->words.constEnd(); it++)
+            for (int ruleIndex : it.value())
+                words[ruleIndex] << it.key();
+        for (auto it = spec->wordsNoCase.constBegin(); it != spec->wordsNoCase.constEnd(); it++)
+            for (int ruleIndex : it.value())
+                wordsNoCase[ruleIndex] << it.key();
+
+        // Multiline rules override everything else in the rules engine, so they go first.
+        // Then later rules go before earlier ones, because they override earlier ones too,
+        // but a rule goes after the rules it skips, because it's not applied inside them.
+        QVector<int> order;
+        QVector<bool> visited(ruleCount);
+        for (int i = 0; i < ruleCount; i++)
+            if (spec->rules.at(i).multiline)
+            {
+                order << i;
+                visited[i] = true;
+            }
+        std::function<void(int)> visit = [&](int i)
+        {
+            if (visited.at(i)) return;
+            visited[i] = true;
+            for (int skipIndex : spec->rules.at(i).skipIndexes)
+                visit(skipIndex);
+            order << i;
+        };
+        for (int i = ruleCount-1; i >= 0; i--)
+            visit(i);
+
+        static QRegularExpression backrefs(QStringLiteral("\\\\(?:[1-9]|g|k)"));
+
+        QStringList patterns;
+        Scanner scanner;
+        int capture = 1;
+        auto addAlt = [&](int ruleIndex, const QString& pattern, int captureCount, bool ignoreCase)
+        {
+            QString alt = '(' + pattern + ')';
+            if (ignoreCase)
+                alt = "(?i:" + alt + ')';
+            patterns << alt;
+            QRegularExpression expr(pattern, ignoreCase ? QRegularExpression::CaseInsensitiveOption : QRegularExpression::NoPatternOption);
+            scanner.alts << Scanner::Alt{ruleIndex, capture, captureCount, expr};
+            capture += captureCount + 1;
+        };
+        for (int i : std::as_const(order))
+        {
+            const auto& rule = spec->rules.at(i);
+            for (const auto& expr : rule.exprs)
+            {
+                if (!expr.isValid())
+                    continue;
+                if (backrefs.match(expr.pattern()).hasMatch())
+                    warning(QStringLiteral("Backreferences are not supported by scanner engine"), ruleStarts[rule.name]);
+                addAlt(i, expr.pattern(), expr.captureCount(),
+                       expr.patternOptions().testFlag(QRegularExpression::CaseInsensitiveOption));
+                // Only the begin marker is a part of combined expression for multiline rules,
+                // the end marker is searched separately after the begin one is found
+                if (rule.multiline)
+                    break;
+            }
+            if (!words.at(i).isEmpty())
+            {
+                words[i].sort();
+                addAlt(i, "\\b(?:" + words.at(i).join('|') + ")\\b", 0, false);
+            }
+            if (!wordsNoCase.at(i).isEmpty())
+            {
+                wordsNoCase[i].sort();
+                addAlt(i, "\\b(?:" + wordsNoCase.at(i).join('|') + ")\\b", 0, true);
+            }
+        }
+
+        scanner.expr.setPattern(patterns.join('|'));
+        if (!scanner.expr.isValid())
+        {
+            warning(QStringLiteral("Unable to combine rules for scanner engine: ") + scanner.expr.errorString(), engineLineNo);
+            spec->engine = Spec::ENGINE_RULES;
+            return;
+        }
+        spec->scanner = scanner;
+    }
+
 public:
     explicit SpecLoader(QTextStream& stream, bool withRawData): stream(stream), withRawData(withRawData)
     {}
@@ -155,6 +387,17 @@ public:
                 if (spec && withRawData)
                     spec->raw[Spec::RAW_TITLE_LINE] = lineNo;
             }
+            else if (key == QStringLiteral("engine"))
+            {
+                if (val == QStringLiteral("scanner"))
+                {
+                    if (spec)
+                        spec->engine = Spec::ENGINE_SCANNER;
+                }
+                else if (val != QStringLiteral("rules"))
+                    warning(QStringLiteral("Unknown engine ") + val);
+                engineLineNo = lineNo;
+            }
             else if (key == QStringLiteral("rule"))
             {
                 break;
@@ -176,6 +419,10 @@ public:
         spec->meta.title.clear();
         spec->raw.clear();
         spec->rules.clear();
+        spec->words.clear();
+        spec->wordsNoCase.clear();
+        spec->engine = Spec::ENGINE_RULES;
+        spec->scanner = Scanner();
 
         if (!loadMeta(spec->meta, spec))
             return warnings;
@@ -307,6 +554,8 @@ public:
             else warning(QStringLiteral("Unknown key"));
         }
         finalizeRule(rule, spec, opts);
+        if (spec->engine == Spec::ENGINE_SCANNER)
+            buildScanner(spec);
         if (withRawData)
         {
             spec->raw[Spec::RAW_CODE] = code.join('\n');
@@ -341,10 +590,277 @@ SpecResult createSpecFromFile(const QString& fileName, bool withRawData)
     return res;
 }
 
+//------------------------------------------------------------------------------
+//                                 Spec cache
+//------------------------------------------------------------------------------
+
+static void optimizeSpec(const Spec& spec)
+{
+    for (const auto& rule : spec.rules)
+        for (const auto& expr : rule.exprs)
+            expr.optimize();
+    if (spec.engine == Spec::ENGINE_SCANNER)
+    {
+        spec.scanner.expr.optimize();
+        for (const auto& alt : spec.scanner.alts)
+            alt.expr.optimize();
+    }
+}
+
+// There are rarely more than a few specs in use, the limit only protects
+// from unbounded growth when an app browses through many spec files
+static const int maxCachedSpecs = 32;
+
+struct CachedSpec
+{
+    QDateTime modified;
+    QSharedPointer<const Spec> spec;
+    quint64 lastUsed;
+};
+
+QSharedPointer<const Spec> cachedSpecFromFile(const QString& fileName, QString* error)
+{
+    static QMutex mutex;
+    static QHash<QString, CachedSpec> cache;
+    static quint64 useCounter = 0;
+
+    QFileInfo fileInfo(fileName);
+    auto key = fileInfo.absoluteFilePath();
+    auto modified = fileInfo.lastModified();
+
+    QMutexLocker locker(&mutex);
+    auto it = cache.find(key);
+    if (it != cache.end() && it->modified == modified)
+    {
+        it->lastUsed = ++useCounter;
+        return it->spec;
+    }
+    locker.unlock();
+
+    // Parsing takes a while, so other specs can be taken from the cache meanwhile.
+    // If the same spec is loaded by several threads at once, the first loaded one is shared.
+    auto res = createSpecFromFile(fileName, false);
+    if (res.spec)
+        optimizeSpec(*res.spec);
+
+    locker.relock();
+    if (!res.spec)
+    {
+        cache.remove(key);
+        if (error)
+            *error = res.error;
+        return QSharedPointer<const Spec>();
+    }
+    it = cache.find(key);
+    if (it != cache.end() && it->modified == modified)
+    {
+        it->lastUsed = ++useCounter;
+        return it->spec;
+    }
+    if (it == cache.end() && cache.size() >= maxCachedSpecs)
+    {
+        auto oldest = cache.begin();
+        for (auto i = cache.begin(); i != cache.end(); i++)
+            if (i->lastUsed < oldest->lastUsed)
+                oldest = i;
+        cache.erase(oldest);
+    }
+    cache[key] = CachedSpec{modified, res.spec, ++useCounter};
+    return res.spec;
+}
+
 //------------------------------------------------------------------------------
 //                               FileStorage
 //------------------------------------------------------------------------------
 
+// Compiled spec is a binary snapshot of parsed spec stored in the app cache directory.
+// Meta index is a single file listing names and titles of all specs of a directory.
+// Both remember size and modification time of source files and are rebuilt when they change.
+// Spec directories are often read-only, so nothing is written next to the sources.
+static const quint32 compiledSpecMagic = 0x4F484C43; // OHLC
+static const quint32 metaIndexMagic = 0x4F484C49; // OHLI
+static const quint16 compiledFormatVersion = 3;
+// The oldest stream version of supported Qt versions, it's stored in file headers,
+// so files are read with the version they were written with
+static const quint16 compiledStreamVersion = QDataStream::Qt_5_6;
+static const QString compiledSpecExt(".ohlc");
+static const QString metaIndexFileName("index.ohli");
+
+struct IndexedMeta
+{
+    qint64 size = -1;
+    qint64 modified = -1;
+    QString name;
+    QString title;
+};
+
+static void writeFileHeader(QDataStream& out, quint32 magic)
+{
+    out.setVersion(compiledStreamVersion);
+    out << magic << compiledFormatVersion << compiledStreamVersion;
+}
+
+// Header values don't depend on the stream version, then the stream is switched to the stored one
+static bool readFileHeader(QDataStream& in, quint32 expectedMagic)
+{
+    quint32 magic;
+    quint16 version, streamVersion;
+    in >> magic >> version >> streamVersion;
+    if (in.status() != QDataStream::Ok ||
+        magic != expectedMagic ||
+        version != compiledFormatVersion ||
+        streamVersion > QDataStream::Qt_DefaultCompiledVersion)
+        return false;
+    in.setVersion(streamVersion);
+    return true;
+}
+
+// Each spec directory gets its own cache subdirectory named by hash of its path
+static QString cacheDirFor(const QString& specDir)
+{
+    auto cacheRoot = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheRoot.isEmpty())
+        return QString();
+    auto hash = QCryptographicHash::hash(QDir(specDir).absolutePath().toUtf8(), QCryptographicHash::Md5);
+    return cacheRoot + "/highlighters/" + QString::fromLatin1(hash.toHex());
+}
+
+// Creates the directory of a cache file before writing it
+static bool makeCacheDir(const QString& fileName)
+{
+    return !fileName.isEmpty() && QFileInfo(fileName).absoluteDir().mkpath(".");
+}
+
+static QString compiledSpecFile(const QFileInfo& source)
+{
+    auto cacheDir = cacheDirFor(source.absolutePath());
+    if (cacheDir.isEmpty())
+        return QString();
+    return cacheDir + '/' + source.completeBaseName() + compiledSpecExt;
+}
+
+QString FileStorage::compiledSpecFileName(const QString& sourceFile)
+{
+    return compiledSpecFile(QFileInfo(sourceFile));
+}
+
+static QSharedPointer<Spec> readCompiledSpec(const QFileInfo& source)
+{
+    QFile file(compiledSpecFile(source));
+    if (!file.exists() || !file.open(QFile::ReadOnly))
+        return QSharedPointer<Spec>();
+
+    QDataStream in(&file);
+    if (!readFileHeader(in, compiledSpecMagic))
+        return QSharedPointer<Spec>();
+    qint64 sourceSize, sourceModified;
+    in >> sourceSize >> sourceModified;
+    if (in.status() != QDataStream::Ok ||
+        sourceSize != source.size() ||
+        sourceModified != source.lastModified().toMSecsSinceEpoch())
+        return QSharedPointer<Spec>();
+
+    QSharedPointer<Spec> spec(new Spec());
+    qint32 engine, ruleCount;
+    in >> spec->meta.name >> spec->meta.title >> engine >> ruleCount;
+    for (int i = 0; i < ruleCount && in.status() == QDataStream::Ok; i++)
+    {
+        Rule rule;
+        QTextFormat format;
+        qint32 group, fontSizeDelta;
+        in >> rule.name >> rule.exprs >> format >> rule.terms >> rule.skips >> rule.skipIndexes
+           >> group >> rule.hyperlink >> rule.multiline >> fontSizeDelta;
+        rule.format = format.toCharFormat();
+        rule.group = group;
+        rule.fontSizeDelta = fontSizeDelta;
+        spec->rules << rule;
+    }
+    qint32 altCount;
+    in >> spec->words >> spec->wordsNoCase >> spec->scanner.expr >> altCount;
+    for (int i = 0; i < altCount && in.status() == QDataStream::Ok; i++)
+    {
+        qint32 rule, capture, captureCount;
+        QRegularExpression expr;
+        in >> rule >> capture >> captureCount >> expr;
+        spec->scanner.alts << Scanner::Alt{rule, capture, captureCount, expr};
+    }
+    if (in.status() != QDataStream::Ok || engine < Spec::ENGINE_RULES || engine > Spec::ENGINE_SCANNER)
+    {
+        qWarning() << "Highlighter::FileStorage: invalid compiled spec" << file.fileName();
+        return QSharedPointer<Spec>();
+    }
+    spec->engine = Spec::Engine(engine);
+    return spec;
+}
+
+static void writeCompiledSpec(const QFileInfo& source, const Spec& spec)
+{
+    auto fileName = compiledSpecFile(source);
+    if (!makeCacheDir(fileName))
+        return;
+    QSaveFile file(fileName);
+    if (!file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Highlighter::FileStorage: unable to write compiled spec" << file.fileName() << "|" << file.errorString();
+        return;
+    }
+    QDataStream out(&file);
+    writeFileHeader(out, compiledSpecMagic);
+    out << source.size() << source.lastModified().toMSecsSinceEpoch();
+    out << spec.meta.name << spec.meta.title << qint32(spec.engine) << qint32(spec.rules.size());
+    for (const auto& rule : spec.rules)
+        out << rule.name << rule.exprs << rule.format << rule.terms << rule.skips << rule.skipIndexes
+            << qint32(rule.group) << rule.hyperlink << rule.multiline << qint32(rule.fontSizeDelta);
+    out << spec.words << spec.wordsNoCase << spec.scanner.expr << qint32(spec.scanner.alts.size());
+    for (const auto& alt : spec.scanner.alts)
+        out << qint32(alt.rule) << qint32(alt.capture) << qint32(alt.captureCount) << alt.expr;
+    file.commit();
+}
+
+static QHash<QString, IndexedMeta> readMetaIndex(const QString& fileName)
+{
+    QHash<QString, IndexedMeta> index;
+    QFile file(fileName);
+    if (!file.exists() || !file.open(QFile::ReadOnly))
+        return index;
+
+    QDataStream in(&file);
+    if (!readFileHeader(in, metaIndexMagic))
+        return index;
+    qint32 count;
+    in >> count;
+    if (in.status() != QDataStream::Ok)
+        return index;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        QString specFileName;
+        IndexedMeta meta;
+        in >> specFileName >> meta.size >> meta.modified >> meta.name >> meta.title;
+        index.insert(specFileName, meta);
+    }
+    if (in.status() != QDataStream::Ok)
+        index.clear();
+    return index;
+}
+
+static void writeMetaIndex(const QString& fileName, const QHash<QString, IndexedMeta>& index)
+{
+    if (!makeCacheDir(fileName))
+        return;
+    QSaveFile file(fileName);
+    if (!file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Highlighter::FileStorage: unable to write meta index" << fileName << "|" << file.errorString();
+        return;
+    }
+    QDataStream out(&file);
+    writeFileHeader(out, metaIndexMagic);
+    out << qint32(index.size());
+    for (auto it = index.constBegin(); it != index.constEnd(); it++)
+        out << it.key() << it->size << it->modified << it->name << it->title;
+    file.commit();
+}
+
 QVector<Meta> FileStorage::loadMetas() const
 {
     QVector<Meta> metas;
@@ -355,36 +871,64 @@ QVector<Meta> FileStorage::loadMetas() const
         return metas;
     }
     //qDebug() << "Hightlighters::FileStorage: dir" << dir.path();
+    auto cacheDir = cacheDirFor(dir.path());
+    auto indexFileName = cacheDir.isEmpty() ? QString() : cacheDir + '/' + metaIndexFileName;
+    auto index = readMetaIndex(indexFileName);
+    QHash<QString, IndexedMeta> freshIndex;
+    bool indexChanged = false;
     for (auto& fileInfo : dir.entryInfoList())
     {
         if (fileInfo.fileName().endsWith(".phl"))
         {
             auto fileName = fileInfo.absoluteFilePath();
-            QFile file(fileName);
-            if (!file.open(QFile::ReadOnly | QFile::Text))
+            auto modified = fileInfo.lastModified().toMSecsSinceEpoch();
+            auto indexed = index.value(fileInfo.fileName());
+            if (indexed.size != fileInfo.size() || indexed.modified != modified)
             {
-                qWarning() << "Highlighter::FileStorage.loadMetas" << fileName << "|" << file.errorString();
-                continue;
+                QFile file(fileName);
+                if (!file.open(QFile::ReadOnly | QFile::Text))
+                {
+                    qWarning() << "Highlighter::FileStorage.loadMetas" << fileName << "|" << file.errorString();
+                    continue;
+                }
+                QTextStream stream(&file);
+                SpecLoader loader(stream, false);
+                Meta meta;
+                if (!loader.loadMeta(meta))
+                {
+                    qWarning() << "Highlighters::FileStorage: meta not loaded" << fileName;
+                    continue;
+                }
+                indexed = IndexedMeta{fileInfo.size(), modified, meta.name, meta.title};
+                indexChanged = true;
             }
-            QTextStream stream(&file);
-            SpecLoader loader(stream, false);
+            freshIndex.insert(fileInfo.fileName(), indexed);
+
+            // The caller is responsible for assigning meta.storage
+            // if it wants to track who loaded the specs (e.g. for saving updated spec)
             Meta meta;
-            if (loader.loadMeta(meta))
-            {
-                // The caller is responsible for assigning meta.storage
-                // if it wants to track who loaded the specs (e.g. for saving updated spec)
-                meta.source = fileName;
-                metas << meta;
-            }
-            else
-                qWarning() << "Highlighters::FileStorage: meta not loaded" << fileName;
+            meta.name = indexed.name;
+            meta.title = indexed.title;
+            meta.source = fileName;
+            metas << meta;
         }
     }
+    if (indexChanged || freshIndex.size() != index.size())
+        writeMetaIndex(indexFileName, freshIndex);
     return metas;
 }
 
 QSharedPointer<Spec> FileStorage::loadSpec(const Meta &meta, bool withRawData) const
 {
+    // Raw data are only required for editing, they are not stored in compiled spec
+    QFileInfo source(meta.source);
+    if (!withRawData)
+    {
+        auto spec = readCompiledSpec(source);
+        if (spec)
+            return spec;
+    }
+
     QFile file(meta.source);
     if (!file.open(QFile::ReadOnly | QFile::Text))
     {
@@ -394,7 +938,9 @@ QSharedPointer<Spec> FileStorage::loadSpec(const Meta &meta, bool withRawData) c
     QTextStream stream(&file);
     QSharedPointer<Spec> spec(new Spec());
     SpecLoader loader(stream, withRawData);
-    loader.loadSpec(spec.get());
+    auto warns = loader.loadSpec(spec.get());
+    if (warns.isEmpty())
+        writeCompiledSpec(source, *spec);
     return spec;
 }
 
@@ -455,119 +1001,34 @@ QSharedPointer<Spec> QrcStorage::loadSpec(const Meta &meta, bool withRawData) co
 }
 
 //------------------------------------------------------------------------------
-//                                 Highlighter
+//                                Rules engine
 //------------------------------------------------------------------------------
 
-Highlighter::Highlighter(QTextDocument *parent, const QSharedPointer<Spec>& spec)
-    : QSyntaxHighlighter(parent), _spec(spec), _document(parent)
-{
-    setObjectName(spec->meta.name);
-}
-
-Highlighter::Highlighter(QPlainTextEdit *parent, const QSharedPointer<Spec>& spec) : Highlighter(parent->document(), spec)
-{
-}
-
-void Highlighter::highlightBlock(const QString &text)
-{
-    bool hasMultilines = false;
-
-    QVector<QVector<QPair<int, int>>> matchedRules(_spec->rules.size());
-
-    for (int i = 0; i < _spec->rules.size(); i++)
-    {
-        const auto &rule = _spec->rules.at(i);
-
-        if (rule.multiline && rule.exprs.size() >= 1)
-        {
-            hasMultilines = true;
-            continue;
-        }
-        for (const auto& expr : rule.exprs)
-        {
-            auto m = expr.match(text);
-            while (m.hasMatch())
-            {
-                int pos = m.capturedStart(rule.group);
-                int length = m.capturedLength(rule.group);
-                
-                matchedRules[i] << qMakePair(pos, length);
-                
-                bool skip = false;
-                for (const auto &skipIndex : std::as_const(rule.skipIndexes))
-                {
-                    const auto &skipMatches = matchedRules.at(skipIndex);
-                    if (!skipMatches.isEmpty())
-                    {
-                        for (const auto &m : skipMatches)
-                        {
-                            if (pos >= m.first && length <= m.second)
-                            {
-                                skip = true;
-                                break;
-                            }
-                        }
-                    }
-                }
-                if (!skip)
-                {
-                    // Font style is applied correctly but highlighter can't make anchors and apply tooltips.
-                    // We do it manually overriding event handlers in MemoEditor.
-                    // There is the bug but seems nobody cares: https://bugreports.qt.io/browse/QTBUG-21553
-                    if (rule.hyperlink)
-                    {
-                        QTextCharFormat format(rule.format);
-                        format.setAnchorHref(m.captured(rule.group));
-                        setFormat(pos, length, format);
-                    }
-                    else if (rule.fontSizeDelta != 0)
-                    {
-                        QTextCharFormat format(rule.format);
-                        format.setFontPointSize(_document->defaultFont().pointSize() + rule.fontSizeDelta);
-                        setFormat(pos, length, format);
-                    }
-                    else
-                        setFormat(pos, length, rule.format);
-                }
-                m = expr.match(text, pos + length);
-            }
-        }
-    }
-    if (hasMultilines)
-    {
-        int offset = 0;
-        setCurrentBlockState(-1);
-        int size = _spec->rules.size();
-        for (int i = 0; i < size; i++)
-        {
-            const auto& rule = _spec->rules.at(i);
-            if (!rule.multiline) continue;
-            offset = matchMultiline(text, rule, i, offset);
-            if (offset < 0) break;
-        }
-    }
-}
-
-int Highlighter::matchMultiline(const QString &text, const Rule& rule, int ruleIndex, int initialOffset)
+static int matchMultiline(const QString &text, const Rule& rule, int ruleIndex, int initialOffset,
+                          int previousState, int& state, FormatRuns& runs, RuleStats* stats = nullptr)
 {
     const auto& exprBeg = rule.exprs[0];
     const auto& exprEnd = rule.exprs[1];
     QRegularExpressionMatch m;
 
-    //qDebug() << rule.name << previousBlockState() << "|" << initialOffset << "|" << text;
+    //qDebug() << rule.name << previousState << "|" << initialOffset << "|" << text;
 
     int start = 0;
     int offset = initialOffset;
-    bool matchEnd = previousBlockState() == ruleIndex;
+    bool matchEnd = previousState == ruleIndex;
     while (true)
     {
         m = (matchEnd ? exprEnd : exprBeg).match(text, offset);
+        if (stats)
+            stats->invocations++;
         if (m.hasMatch())
         {
+            if (stats && !matchEnd)
+                stats->matches++;
             if (matchEnd)
             {
-                setFormat(start, m.capturedEnd()-start, rule.format);
-                setCurrentBlockState(-1);
+                runs << FormatRun{start, m.capturedEnd()-start, ruleIndex};
+                state = -1;
                 matchEnd = false;
                 //qDebug() << "    has-match(end)" << start << m.capturedEnd()-start;
             }
@@ -585,8 +1046,8 @@ int Highlighter::matchMultiline(const QString &text, const Rule& rule, int ruleI
             if (matchEnd)
             {
                 //qDebug() << "    no-match(end)" << start << text.length()-start;
-                setFormat(start, text.length()-start, rule.format);
-                setCurrentBlockState(ruleIndex);
+                runs << FormatRun{start, text.length()-start, ruleIndex};
+                state = ruleIndex;
                 offset = -1;
             }
             else
@@ -600,15 +1061,1020 @@ int Highlighter::matchMultiline(const QString &text, const Rule& rule, int ruleI
     return offset;
 }
 
-Highlighter *setHighlighter(QPlainTextEdit* editor, const QString& fileName)
+static int matchRules(const Spec& spec, const QString &text, int previousState, FormatRuns& runs, RulesStats* stats)
 {
-    auto res = createSpecFromFile(fileName, false);
-    if (!res.spec)
+    bool hasMultilines = false;
+    QElapsedTimer timer;
+
+    MatchedRanges matchedRules(spec.rules.size());
+
+    if (!spec.words.isEmpty() || !spec.wordsNoCase.isEmpty())
+        matchWords(spec, text, matchedRules);
+
+    for (int i = 0; i < spec.rules.size(); i++)
+    {
+        const auto &rule = spec.rules.at(i);
+
+        if (rule.multiline && rule.exprs.size() >= 1)
+        {
+            hasMultilines = true;
+            continue;
+        }
+
+        auto isSkipped = [&rule, &matchedRules](int pos, int length) {
+            for (const auto &skipIndex : std::as_const(rule.skipIndexes))
+                if (matchedRules[skipIndex].contains(pos, length))
+                    return true;
+            return false;
+        };
+
+        RuleStats* ruleStats = stats ? &(*stats)[i] : nullptr;
+        if (ruleStats)
+            timer.start();
+
+        // Terms have already been found among words of the block
+        const auto wordMatches = matchedRules.at(i).ranges();
+        for (const auto &m : wordMatches)
+            if (!isSkipped(m.first, m.second - m.first))
+                runs << FormatRun{m.first, m.second - m.first, i};
+            else if (ruleStats)
+                ruleStats->skipped++;
+
+        for (const auto& expr : rule.exprs)
+        {
+            auto m = expr.match(text);
+            if (ruleStats)
+                ruleStats->invocations++;
+            while (m.hasMatch())
+            {
+                if (ruleStats)
+                    ruleStats->matches++;
+
+                int pos = m.capturedStart(rule.group);
+                int length = m.capturedLength(rule.group);
+                
+                matchedRules[i].add(pos, length);
+                
+                if (!isSkipped(pos, length))
+                    runs << FormatRun{pos, length, i};
+                else if (ruleStats)
+                    ruleStats->skipped++;
+
+                m = expr.match(text, pos + length);
+                if (ruleStats)
+                    ruleStats->invocations++;
+            }
+        }
+
+        if (ruleStats)
+        {
+            ruleStats->matches += wordMatches.size();
+            ruleStats->nsecs += timer.nsecsElapsed();
+        }
+    }
+    int state = -1;
+    if (hasMultilines)
+    {
+        int offset = 0;
+        int size = spec.rules.size();
+        for (int i = 0; i < size; i++)
+        {
+            const auto& rule = spec.rules.at(i);
+            if (!rule.multiline) continue;
+            if (stats)
+            {
+                timer.start();
+                offset = matchMultiline(text, rule, i, offset, previousState, state, runs, &(*stats)[i]);
+                (*stats)[i].nsecs += timer.nsecsElapsed();
+            }
+            else
+                offset = matchMultiline(text, rule, i, offset, previousState, state, runs);
+            if (offset < 0) break;
+        }
+    }
+    return state;
+}
+
+//------------------------------------------------------------------------------
+//                               Scanner engine
+//------------------------------------------------------------------------------
+
+static void scanPart(const Spec& spec, const QString &text, int offset, int limit, FormatRuns& runs);
+
+static inline int altGroup(const Spec& spec, const Scanner::Alt& alt)
+{
+    int group = spec.rules.at(alt.rule).group;
+    return group <= alt.captureCount ? group : 0;
+}
+
+// Adds a run for the group matched by the rule and scans parts of the match around the group,
+// they are not taken by the rule, so they still can be matched by others
+static void takeGroup(const Spec& spec, const QString &text, int ruleIndex, int start, int end,
+                      int groupStart, int groupEnd, FormatRuns& runs)
+{
+    if (groupStart < 0)
+        return;
+    if (groupStart > start)
+        scanPart(spec, text, start, groupStart, runs);
+    if (groupEnd > groupStart)
+        runs << FormatRun{groupStart, groupEnd-groupStart, ruleIndex};
+    if (groupEnd < end)
+        scanPart(spec, text, groupEnd, end, runs);
+}
+
+// Finds the first match fitting into [offset, limit) in the same way as the combined expression does:
+// the earliest match wins, and the first alternative wins among matches at the same position.
+// Alternatives are matched one by one, so a match of one of them going over the limit
+// doesn't hide shorter matches of the others at the same position.
+// Matches having empty groups are not taken, they'd give the same part to scan again.
+static QRegularExpressionMatch matchPart(const Spec& spec, const QString &text, int offset, int limit, int& altIndex)
+{
+    const auto& scanner = spec.scanner;
+    QRegularExpressionMatch best;
+    for (int i = 0; i < scanner.alts.size(); i++)
+    {
+        const auto& expr = scanner.alts.at(i).expr;
+        const int group = altGroup(spec, scanner.alts.at(i));
+        auto m = expr.match(text, offset);
+        while (m.hasMatch() && m.capturedStart() < limit && (m.capturedEnd() > limit || m.capturedLength(group) == 0))
+            m = expr.match(text, m.capturedStart() + 1);
+        if (!m.hasMatch() || m.capturedStart() >= limit)
+            continue;
+        if (!best.hasMatch() || m.capturedStart() < best.capturedStart())
+        {
+            best = m;
+            altIndex = i;
+            if (m.capturedStart() == offset)
+                break;
+        }
+    }
+    return best;
+}
+
+// Scans a part of a block around a matched capture group. The whole block text is still visible
+// to expressions, so lookarounds, \b and $ work as in the rules engine, but matches must fit into the part.
+// A multiline rule can't continue to the next block from here.
+static void scanPart(const Spec& spec, const QString &text, int offset, int limit, FormatRuns& runs)
+{
+    int altIndex = -1;
+    while (offset < limit)
+    {
+        auto m = matchPart(spec, text, offset, limit, altIndex);
+        if (!m.hasMatch())
+            break;
+
+        const auto& alt = spec.scanner.alts.at(altIndex);
+        const auto& rule = spec.rules.at(alt.rule);
+        int start = m.capturedStart();
+        int end = m.capturedEnd();
+        if (rule.multiline)
+        {
+            auto e = rule.exprs.at(1).match(text, end);
+            if (!e.hasMatch() || e.capturedEnd() > limit)
+            {
+                runs << FormatRun{start, limit-start, alt.rule};
+                break;
+            }
+            runs << FormatRun{start, e.capturedEnd()-start, alt.rule};
+            offset = e.capturedEnd();
+            continue;
+        }
+
+        int group = altGroup(spec, alt);
+        takeGroup(spec, text, alt.rule, start, end, m.capturedStart(group), m.capturedEnd(group), runs);
+        offset = end;
+    }
+}
+
+static int scan(const Spec& spec, const QString &text, int offset, FormatRuns& runs)
+{
+    const auto& scanner = spec.scanner;
+    const int length = text.length();
+    int state = -1;
+    if (scanner.alts.isEmpty())
+        return state;
+    while (offset < length)
+    {
+        auto m = scanner.expr.match(text, offset);
+        if (!m.hasMatch())
+            break;
+
+        int start = m.capturedStart();
+        int end = m.capturedEnd();
+        const Scanner::Alt* alt = nullptr;
+        for (const auto& a : scanner.alts)
+            if (m.capturedStart(a.capture) >= 0)
+            {
+                alt = &a;
+                break;
+            }
+        if (!alt || end == start)
+        {
+            offset = start + 1;
+            continue;
+        }
+
+        const auto& rule = spec.rules.at(alt->rule);
+        if (rule.multiline)
+        {
+            auto e = rule.exprs.at(1).match(text, end);
+            if (!e.hasMatch())
+            {
+                runs << FormatRun{start, length-start, alt->rule};
+                state = alt->rule;
+                break;
+            }
+            runs << FormatRun{start, e.capturedEnd()-start, alt->rule};
+            offset = e.capturedEnd();
+            continue;
+        }
+
+        int group = altGroup(spec, *alt);
+        takeGroup(spec, text, alt->rule, start, end, m.capturedStart(alt->capture + group),
+                  m.capturedEnd(alt->capture + group), runs);
+        offset = end;
+    }
+    return state;
+}
+
+static int matchScanner(const Spec& spec, const QString &text, int previousState, FormatRuns& runs)
+{
+    int offset = 0;
+    if (previousState >= 0 && previousState < spec.rules.size() && spec.rules.at(previousState).multiline)
+    {
+        auto m = spec.rules.at(previousState).exprs.at(1).match(text);
+        if (!m.hasMatch())
+        {
+            runs << FormatRun{0, text.length(), previousState};
+            return previousState;
+        }
+        runs << FormatRun{0, m.capturedEnd(), previousState};
+        offset = m.capturedEnd();
+    }
+    return scan(spec, text, offset, runs);
+}
+
+int matchBlock(const Spec& spec, const QString &text, int previousState, FormatRuns& runs, RulesStats* stats)
+{
+    if (spec.engine != Spec::ENGINE_SCANNER)
+        return matchRules(spec, text, previousState, runs, stats);
+
+    int firstRun = runs.size();
+    int state = matchScanner(spec, text, previousState, runs);
+    if (stats)
+        for (int i = firstRun; i < runs.size(); i++)
+            (*stats)[runs.at(i).rule].matches++;
+    return state;
+}
+
+int matchBlockState(const Spec& spec, const QString &text, int previousState)
+{
+    bool hasMultilines = false;
+    for (const auto& rule : spec.rules)
+        if (rule.multiline)
+        {
+            hasMultilines = true;
+            break;
+        }
+    if (!hasMultilines)
+        return -1;
+
+    FormatRuns runs;
+
+    // Any token can hide a multiline rule opener, so the scanner has to go through the whole block,
+    // but only when there is an opener at all, most blocks don't have one and the state is known
+    if (spec.engine == Spec::ENGINE_SCANNER)
+    {
+        int offset = 0;
+        if (previousState >= 0 && previousState < spec.rules.size() && spec.rules.at(previousState).multiline)
+        {
+            auto m = spec.rules.at(previousState).exprs.at(1).match(text);
+            if (!m.hasMatch())
+                return previousState;
+            offset = m.capturedEnd();
+        }
+        bool hasOpener = false;
+        for (const auto& rule : spec.rules)
+            if (rule.multiline && rule.exprs.at(0).match(text, offset).hasMatch())
+            {
+                hasOpener = true;
+                break;
+            }
+        if (!hasOpener)
+            return -1;
+        return matchScanner(spec, text, previousState, runs);
+    }
+
+    int state = -1;
+    int offset = 0;
+    for (int i = 0; i < spec.rules.size(); i++)
+    {
+        const auto& rule = spec.rules.at(i);
+        if (!rule.multiline) continue;
+        offset = matchMultiline(text, rule, i, offset, previousState, state, runs);
+        if (offset < 0) break;
+    }
+    return state;
+}
+
+//------------------------------------------------------------------------------
+//                                  Headless
+//------------------------------------------------------------------------------
+
+const FormatRuns& Tokenizer::tokenize(const QString& line)
+{
+    _runs.clear();
+    _tokens.clear();
+    _state = matchBlock(*_spec, line, _state, _runs);
+    if (_runs.isEmpty())
+        return _tokens;
+
+    // Each char is owned by the last run covering it, as QSyntaxHighlighter::setFormat() does
+    const int length = line.length();
+    _owners.fill(-1, length);
+    for (const auto& run : std::as_const(_runs))
+    {
+        int end = qMin(length, run.start + run.length);
+        for (int i = qMax(0, run.start); i < end; i++)
+            _owners[i] = run.rule;
+    }
+    int i = 0;
+    while (i < length)
+    {
+        int rule = _owners.at(i);
+        int start = i;
+        while (i < length && _owners.at(i) == rule) i++;
+        if (rule >= 0)
+            _tokens << FormatRun{start, i - start, rule};
+    }
+    return _tokens;
+}
+
+void tokenizeText(const QSharedPointer<const Spec>& spec, const QString& text,
+                  const std::function<void(const QString& line, const FormatRuns& tokens)>& visitor)
+{
+    Tokenizer tokenizer(spec);
+    const int size = text.size();
+    int start = 0;
+    while (true)
+    {
+        int end = start;
+        while (end < size)
+        {
+            QChar c = text.at(end);
+            if (c == '\n' || c == '\r' || c == QChar::ParagraphSeparator)
+                break;
+            end++;
+        }
+        auto line = text.mid(start, end - start);
+        visitor(line, tokenizer.tokenize(line));
+        if (end >= size)
+            break;
+        start = end + 1;
+        if (text.at(end) == '\r' && start < size && text.at(start) == '\n')
+            start++;
+    }
+}
+
+static QString htmlStyle(const Rule& rule)
+{
+    const auto& format = rule.format;
+    QStringList styles;
+    if (format.hasProperty(QTextFormat::ForegroundBrush))
+        styles << QStringLiteral("color:") + format.foreground().color().name();
+    if (format.hasProperty(QTextFormat::BackgroundBrush))
+        styles << QStringLiteral("background-color:") + format.background().color().name();
+    if (format.hasProperty(QTextFormat::FontWeight) && format.fontWeight() >= QFont::Bold)
+        styles << QStringLiteral("font-weight:bold");
+    if (format.fontItalic())
+        styles << QStringLiteral("font-style:italic");
+    QStringList decorations;
+    if (format.fontUnderline())
+        decorations << QStringLiteral("underline");
+    if (format.fontStrikeOut())
+        decorations << QStringLiteral("line-through");
+    if (!decorations.isEmpty())
+        styles << QStringLiteral("text-decoration:") + decorations.join(' ');
+    if (rule.fontSizeDelta != 0)
+        styles << QStringLiteral("font-size:calc(1em %1 %2pt)")
+                  .arg(QLatin1Char(rule.fontSizeDelta > 0 ? '+' : '-')).arg(qAbs(rule.fontSizeDelta));
+    return styles.join(';');
+}
+
+QString toHtml(const QSharedPointer<const Spec>& spec, const QString& text)
+{
+    QVector<QString> styles;
+    for (const auto& rule : spec->rules)
+        styles << htmlStyle(rule);
+
+    QString html;
+    html.reserve(text.size() * 2);
+    bool firstLine = true;
+    tokenizeText(spec, text, [&](const QString& line, const FormatRuns& tokens){
+        if (!firstLine)
+            html += '\n';
+        firstLine = false;
+        int pos = 0;
+        for (const auto& token : tokens)
+        {
+            if (token.start > pos)
+                html += line.mid(pos, token.start - pos).toHtmlEscaped();
+            auto part = line.mid(token.start, token.length).toHtmlEscaped();
+            const auto& style = styles.at(token.rule);
+            if (spec->rules.at(token.rule).hyperlink)
+                html += QStringLiteral("<a href=\"") + part + QStringLiteral("\" style=\"") + style + QStringLiteral("\">") + part + QStringLiteral("</a>");
+            else if (!style.isEmpty())
+                html += QStringLiteral("<span style=\"") + style + QStringLiteral("\">") + part + QStringLiteral("</span>");
+            else
+                html += part;
+            pos = token.start + token.length;
+        }
+        if (pos < line.length())
+            html += line.mid(pos).toHtmlEscaped();
+    });
+    return html;
+}
+
+static QString ansiStyle(const QTextCharFormat& format)
+{
+    QStringList codes;
+    if (format.hasProperty(QTextFormat::FontWeight) && format.fontWeight() >= QFont::Bold)
+        codes << QStringLiteral("1");
+    if (format.fontItalic())
+        codes << QStringLiteral("3");
+    if (format.fontUnderline())
+        codes << QStringLiteral("4");
+    if (format.fontStrikeOut())
+        codes << QStringLiteral("9");
+    if (format.hasProperty(QTextFormat::ForegroundBrush))
+    {
+        auto c = format.foreground().color();
+        codes << QStringLiteral("38;2;%1;%2;%3").arg(c.red()).arg(c.green()).arg(c.blue());
+    }
+    if (format.hasProperty(QTextFormat::BackgroundBrush))
+    {
+        auto c = format.background().color();
+        codes << QStringLiteral("48;2;%1;%2;%3").arg(c.red()).arg(c.green()).arg(c.blue());
+    }
+    if (codes.isEmpty())
+        return QString();
+    return QStringLiteral("\x1b[") + codes.join(';') + 'm';
+}
+
+QString toAnsi(const QSharedPointer<const Spec>& spec, const QString& text)
+{
+    static const QString reset("\x1b[0m");
+
+    QVector<QString> styles;
+    for (const auto& rule : spec->rules)
+        styles << ansiStyle(rule.format);
+
+    QString ansi;
+    ansi.reserve(text.size() * 2);
+    bool firstLine = true;
+    tokenizeText(spec, text, [&](const QString& line, const FormatRuns& tokens){
+        if (!firstLine)
+            ansi += '\n';
+        firstLine = false;
+        int pos = 0;
+        for (const auto& token : tokens)
+        {
+            if (token.start > pos)
+                ansi += line.mid(pos, token.start - pos);
+            const auto& style = styles.at(token.rule);
+            if (!style.isEmpty())
+                ansi += style + line.mid(token.start, token.length) + reset;
+            else
+                ansi += line.mid(token.start, token.length);
+            pos = token.start + token.length;
+        }
+        if (pos < line.length())
+            ansi += line.mid(pos);
+    });
+    return ansi;
+}
+
+//------------------------------------------------------------------------------
+//                            Deferred highlighting
+//------------------------------------------------------------------------------
+
+// Blocks are highlighted in chunks of this duration when the application is idle
+static const int deferredChunkMs = 10;
+
+// Background job is started after edits settle down during this time
+static const int threadedDelayMs = 50;
+
+struct CachedBlock
+{
+    QString text;
+    int inState = -2;
+    int outState = -1;
+    FormatRuns runs;
+};
+
+using JobLink = WorkerLink<QVector<CachedBlock>>;
+
+// Matches a range of blocks in a snapshot of the document text, runs in a worker thread
+class HighlightJob : public QRunnable
+{
+public:
+    QSharedPointer<const Spec> spec;
+    QSharedPointer<JobLink> link;
+    QString snapshot;
+    int firstBlock;
+    int lastBlock;
+    int inState;
+
+    void run() override
+    {
+        QVector<CachedBlock> blocks;
+        blocks.reserve(lastBlock - firstBlock + 1);
+        int state = inState;
+        int blockNumber = 0;
+        int start = 0;
+        const int size = snapshot.size();
+        while (start <= size && blockNumber <= lastBlock)
+        {
+            int end = snapshot.indexOf(QChar::ParagraphSeparator, start);
+            if (end < 0) end = size;
+            if (blockNumber >= firstBlock)
+            {
+                if ((blockNumber & 0xFF) == 0 && link->isCancelled())
+                    return;
+                CachedBlock block;
+                block.text = snapshot.mid(start, end - start);
+                block.inState = state;
+                state = matchBlock(*spec, block.text, state, block.runs);
+                block.outState = state;
+                blocks << block;
+            }
+            start = end + 1;
+            blockNumber++;
+        }
+        link->deliver(blocks);
+    }
+};
+
+struct DeferredState
+{
+    QTimer timer;
+
+    // Threaded mode
+    bool threaded = false;
+    bool jobRunning = false;
+    int generation = 0;
+    QTimer jobTimer;
+    QSharedPointer<JobLink> link;
+    QVector<CachedBlock> cache;
+
+    ~DeferredState()
+    {
+        cancelJob();
+    }
+
+    void cancelJob()
+    {
+        if (!link) return;
+        link->cancel();
+        jobRunning = false;
+    }
+
+    const CachedBlock* cached(int block, const QString& text, int inState) const
+    {
+        if (block >= cache.size()) return nullptr;
+        const auto& c = cache.at(block);
+        return c.inState == inState && c.text == text ? &c : nullptr;
+    }
+
+    void setCached(int block, const CachedBlock& c)
+    {
+        if (cache.size() <= block)
+            cache.resize(block + 1);
+        cache[block] = c;
+    }
+    int blockCount = 0;
+    int forcedBlock = -1;
+    int visibleFirst = -1;
+    int visibleLast = -1;
+    bool visibleDirty = true;
+
+    // Sorted, non-overlapping and non-adjacent ranges [first, last] of block numbers
+    // having only states computed. Blocks are mostly marked one after another,
+    // so there are a few ranges even in large documents.
+    QVector<QPair<int, int>> pending;
+
+    using Iter = QVector<QPair<int, int>>::iterator;
+
+    Iter findRange(int block)
+    {
+        return std::lower_bound(pending.begin(), pending.end(), block,
+            [](const QPair<int, int>& r, int b){ return r.second < b; });
+    }
+
+    bool isPending(int block)
+    {
+        auto it = findRange(block);
+        return it != pending.end() && it->first <= block;
+    }
+
+    bool isVisible(int block) const
+    {
+        return block >= visibleFirst && block <= visibleLast;
+    }
+
+    int pendingCount() const
+    {
+        int count = 0;
+        for (const auto& r : pending)
+            count += r.second - r.first + 1;
+        return count;
+    }
+
+    void markPending(int block)
+    {
+        if (pending.isEmpty() || pending.last().second < block - 1)
+        {
+            pending << qMakePair(block, block);
+            return;
+        }
+        if (pending.last().second == block - 1)
+        {
+            pending.last().second = block;
+            return;
+        }
+        auto it = findRange(block);
+        if (it != pending.end() && it->first <= block)
+            return;
+        bool joinPrev = it != pending.begin() && (it-1)->second == block - 1;
+        bool joinNext = it != pending.end() && it->first == block + 1;
+        if (joinPrev && joinNext)
+        {
+            (it-1)->second = it->second;
+            pending.erase(it);
+        }
+        else if (joinPrev)
+            (it-1)->second = block;
+        else if (joinNext)
+            it->first = block;
+        else
+            pending.insert(it, qMakePair(block, block));
+    }
+
+    void markDone(int block)
+    {
+        auto it = findRange(block);
+        if (it == pending.end() || it->first > block)
+            return;
+        if (it->first == it->second)
+            pending.erase(it);
+        else if (it->first == block)
+            it->first++;
+        else if (it->second == block)
+            it->second--;
+        else
+        {
+            int last = it->second;
+            it->second = block - 1;
+            pending.insert(it+1, qMakePair(block + 1, last));
+        }
+    }
+
+    // Blocks [first, lastOld] have been replaced with another number of blocks, following
+    // blocks are renumbered. Replaced blocks are dropped, they are going to be highlighted anew.
+    void shift(int first, int lastOld, int delta)
+    {
+        QVector<QPair<int, int>> shifted;
+        shifted.reserve(pending.size() + 1);
+        for (const auto& r : std::as_const(pending))
+        {
+            if (r.first < first)
+                shifted << qMakePair(r.first, qMin(r.second, first - 1));
+            if (r.second > lastOld)
+            {
+                int from = qMax(r.first, lastOld + 1) + delta;
+                if (!shifted.isEmpty() && shifted.last().second >= from - 1)
+                    shifted.last().second = r.second + delta;
+                else
+                    shifted << qMakePair(from, r.second + delta);
+            }
+        }
+        pending = shifted;
+    }
+};
+
+//------------------------------------------------------------------------------
+//                                 Highlighter
+//------------------------------------------------------------------------------
+
+Highlighter::Highlighter(QTextDocument *parent, const QSharedPointer<const Spec>& spec)
+    : QSyntaxHighlighter(static_cast<QObject*>(parent)), _spec(spec), _document(parent)
+{
+    setObjectName(spec->meta.name);
+
+    // In deferred mode, block numbers must be shifted before the base class rehighlights
+    // changed blocks, so our handler is connected before the document is attached
+    connect(_document, &QTextDocument::contentsChange, this, &Highlighter::documentChanged);
+    setDocument(_document);
+}
+
+Highlighter::Highlighter(QPlainTextEdit *parent, const QSharedPointer<const Spec>& spec) : Highlighter(parent->document(), spec)
+{
+    _editor = parent;
+}
+
+Highlighter::~Highlighter()
+{
+}
+
+void Highlighter::setProfiling(bool on)
+{
+    _profiling = on;
+    if (on && _stats.size() != _spec->rules.size())
+        resetRulesStats();
+}
+
+void Highlighter::resetRulesStats()
+{
+    _stats = RulesStats(_spec->rules.size());
+}
+
+bool Highlighter::isThreaded() const
+{
+    return _deferred && _deferred->threaded;
+}
+
+void Highlighter::setDeferred(bool on)
+{
+    if (on == isDeferred()) return;
+
+    if (on)
+    {
+        _deferred.reset(new DeferredState);
+        _deferred->blockCount = _document->blockCount();
+        _deferred->timer.setInterval(0);
+        connect(&_deferred->timer, &QTimer::timeout, this, &Highlighter::processDeferred);
+        if (_editor)
+            connect(_editor, &QPlainTextEdit::updateRequest, this, [this]{
+                _deferred->visibleDirty = true;
+                if (!_deferred->pending.isEmpty())
+                    _deferred->timer.start();
+            });
+        updateVisibleBlocks();
+    }
+    else
+    {
+        if (_editor)
+            disconnect(_editor, &QPlainTextEdit::updateRequest, this, nullptr);
+        bool hasPending = !_deferred->pending.isEmpty();
+        _deferred.reset();
+        if (hasPending)
+            rehighlight();
+    }
+}
+
+void Highlighter::documentChanged(int position, int charsRemoved, int charsAdded)
+{
+    Q_UNUSED(charsRemoved)
+
+    if (!_deferred) return;
+
+    int blockCount = _document->blockCount();
+    int delta = blockCount - _deferred->blockCount;
+    _deferred->blockCount = blockCount;
+    // Changed blocks are going to be rehighlighted anyway, nothing to do when they are not renumbered
+    if (delta == 0) return;
+
+    int first = _document->findBlock(position).blockNumber();
+    auto lastBlock = _document->findBlock(position + charsAdded);
+    int lastNew = lastBlock.isValid() ? lastBlock.blockNumber() : blockCount - 1;
+    int lastOld = lastNew - delta;
+    _deferred->shift(first, lastOld, delta);
+    _deferred->visibleDirty = true;
+
+    auto& cache = _deferred->cache;
+    if (first < cache.size())
+    {
+        cache.remove(first, qMin(lastOld, cache.size() - 1) - first + 1);
+        cache.insert(first, lastNew - first + 1, CachedBlock());
+    }
+    // Results of a running job are numbered in the old way
+    _deferred->generation++;
+}
+
+void Highlighter::setThreaded(bool on)
+{
+    if (on == isThreaded()) return;
+
+    if (!on)
+    {
+        _deferred->threaded = false;
+        _deferred->cancelJob();
+        _deferred->cache.clear();
+        if (!_deferred->pending.isEmpty())
+            _deferred->timer.start();
+        return;
+    }
+
+    if (!_deferred)
+        setDeferred(true);
+    _deferred->threaded = true;
+    _deferred->jobTimer.setSingleShot(true);
+    _deferred->jobTimer.setInterval(threadedDelayMs);
+    connect(&_deferred->jobTimer, &QTimer::timeout, this, &Highlighter::startJob, Qt::UniqueConnection);
+    if (!_deferred->pending.isEmpty())
+        scheduleJob();
+}
+
+void Highlighter::scheduleJob()
+{
+    if (!_deferred->jobRunning && !_deferred->jobTimer.isActive())
+        _deferred->jobTimer.start();
+}
+
+void Highlighter::startJob()
+{
+    if (!_deferred || !_deferred->threaded || _deferred->pending.isEmpty() || _deferred->jobRunning)
+        return;
+
+    auto job = new HighlightJob;
+    job->spec = _spec;
+    job->snapshot = _document->toRawText();
+    job->firstBlock = _deferred->pending.first().first;
+    job->lastBlock = _deferred->pending.last().second;
+    job->inState = job->firstBlock > 0 ? _document->findBlockByNumber(job->firstBlock-1).userState() : -1;
+
+    QSharedPointer<JobLink> link(new JobLink);
+    int generation = _deferred->generation;
+    int firstBlock = job->firstBlock;
+    link->post = [this, generation, firstBlock, l = link.data()](const QVector<CachedBlock>& blocks){
+        QMetaObject::invokeMethod(this, [this, generation, firstBlock, l, blocks]{
+            if (!_deferred || _deferred->link.data() != l)
+                return;
+            _deferred->jobRunning = false;
+            if (generation == _deferred->generation)
+                for (int i = 0; i < blocks.size(); i++)
+                    _deferred->setCached(firstBlock + i, blocks.at(i));
+            if (!_deferred->pending.isEmpty())
+                _deferred->timer.start();
+        }, Qt::QueuedConnection);
+    };
+    job->link = link;
+
+    _deferred->cancelJob();
+    _deferred->link = link;
+    _deferred->jobRunning = true;
+    QThreadPool::globalInstance()->start(job);
+}
+
+void Highlighter::updateVisibleBlocks()
+{
+    _deferred->visibleDirty = false;
+    if (!_editor || !_editor->isVisible())
+    {
+        _deferred->visibleFirst = -1;
+        _deferred->visibleLast = -1;
+        return;
+    }
+    auto viewport = _editor->viewport();
+    _deferred->visibleFirst = _editor->cursorForPosition(QPoint(0, 0)).blockNumber();
+    _deferred->visibleLast = _editor->cursorForPosition(QPoint(0, viewport->height())).blockNumber();
+}
+
+void Highlighter::processDeferred()
+{
+    // Someone has switched the highlighter to another document
+    if (document() != _document)
+    {
+        _deferred->timer.stop();
+        _deferred->pending.clear();
+        return;
+    }
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    // Returns false if the block is still pending, it only can happen
+    // in threaded mode when a not forced block has no cached runs yet
+    auto highlightPending = [this](int blockNumber, bool force){
+        auto block = _document->findBlockByNumber(blockNumber);
+        if (!block.isValid())
+        {
+            _deferred->markDone(blockNumber);
+            return true;
+        }
+        if (force)
+            _deferred->forcedBlock = blockNumber;
+        rehighlightBlock(block);
+        _deferred->forcedBlock = -1;
+        return !_deferred->isPending(blockNumber);
+    };
+
+    if (_deferred->visibleDirty)
+        updateVisibleBlocks();
+    if (_deferred->visibleFirst >= 0)
+        for (int n = _deferred->visibleFirst; n <= _deferred->visibleLast; n++)
+            if (_deferred->isPending(n))
+                highlightPending(n, true);
+
+    bool waitJob = false;
+    while (!_deferred->pending.isEmpty() && elapsed.elapsed() < deferredChunkMs)
+        if (!highlightPending(_deferred->pending.first().first, !_deferred->threaded))
+        {
+            waitJob = true;
+            break;
+        }
+
+    int total = _document->blockCount();
+    emit deferredProgress(total - _deferred->pendingCount(), total);
+
+    if (waitJob)
+    {
+        // The timer is restarted when the job is done
+        _deferred->timer.stop();
+        scheduleJob();
+    }
+    else if (_deferred->pending.isEmpty())
+    {
+        _deferred->timer.stop();
+        emit deferredFinished();
+    }
+}
+
+void Highlighter::highlightBlock(const QString &text)
+{
+    int previousState = previousBlockState();
+    if (_deferred)
+    {
+        int blockNumber = currentBlock().blockNumber();
+        if (_deferred->threaded)
+        {
+            auto cached = _deferred->cached(blockNumber, text, previousState);
+            if (cached)
+            {
+                _deferred->markDone(blockNumber);
+                setCurrentBlockState(cached->outState);
+                for (const auto& run : std::as_const(cached->runs))
+                    applyRule(_spec->rules.at(run.rule), text, run.start, run.length);
+                return;
+            }
+        }
+        if (blockNumber != _deferred->forcedBlock && !_deferred->isVisible(blockNumber))
+        {
+            // Formats of the block are cleared by the base class as we don't set any
+            setCurrentBlockState(matchBlockState(*_spec, text, previousState));
+            _deferred->markPending(blockNumber);
+            if (_deferred->threaded)
+                scheduleJob();
+            else if (!_deferred->timer.isActive())
+                _deferred->timer.start();
+            return;
+        }
+        _deferred->markDone(blockNumber);
+    }
+
+    _runs.clear();
+    if (_profiling && _stats.size() != _spec->rules.size())
+        _stats = RulesStats(_spec->rules.size());
+    int state = matchBlock(*_spec, text, previousState, _runs, _profiling ? &_stats : nullptr);
+    setCurrentBlockState(state);
+    for (const auto& run : std::as_const(_runs))
+        applyRule(_spec->rules.at(run.rule), text, run.start, run.length);
+
+    if (_deferred && _deferred->threaded)
+        _deferred->setCached(currentBlock().blockNumber(), CachedBlock{text, previousState, state, _runs});
+}
+
+void Highlighter::applyRule(const Rule& rule, const QString &text, int pos, int length)
+{
+    // Font style is applied correctly but highlighter can't make anchors and apply tooltips.
+    // We do it manually overriding event handlers in MemoEditor.
+    // There is the bug but seems nobody cares: https://bugreports.qt.io/browse/QTBUG-21553
+    if (rule.hyperlink)
+    {
+        QTextCharFormat format(rule.format);
+        format.setAnchorHref(text.mid(pos, length));
+        setFormat(pos, length, format);
+    }
+    else if (rule.fontSizeDelta != 0)
+    {
+        QTextCharFormat format(rule.format);
+        format.setFontPointSize(_document->defaultFont().pointSize() + rule.fontSizeDelta);
+        setFormat(pos, length, format);
+    }
+    else
+        setFormat(pos, length, rule.format);
+}
+
+Highlighter *setHighlighter(QPlainTextEdit* editor, const QString& fileName)
+{
+    QString error;
+    auto spec = cachedSpecFromFile(fileName, &error);
+    if (!spec)
     {
-        qWarning() << "Unable to set highighter" << fileName << res.error;
+        qWarning() << "Unable to set highighter" << fileName << error;
         return nullptr;
     }
-    return new Highlighter(editor->document(), res.spec);
+    return new Highlighter(editor, spec);
 }
 
 } // namespace Highlighter
@@ -4,6 +4,9 @@
 #include <QRegularExpression>
 #include <QSyntaxHighlighter>
 
+#include <functional>
+#include <memory>
+
 QT_BEGIN_NAMESPACE
 class QPlainTextEdit;
 QT_END_NAMESPACE
@@ -41,6 +44,8 @@ struct Rule
     QString name;
     QVector<QRegularExpression> exprs;
     QTextCharFormat format;
+    /// Terms consisting only of word characters are not converted into expressions,
+    /// they are put into Spec::words lookup tables and always matched as whole words
     QStringList terms;
     /// List of other rule names.
     /// If they are matched, then the current rule formatting will not be applied
@@ -53,11 +58,46 @@ struct Rule
 };
 
 
+/// All expressions of a spec combined into a single one as ordered alternatives.
+/// It is used by the scanner engine to tokenize a block in one left-to-right pass.
+struct Scanner
+{
+    struct Alt
+    {
+        /// Index of rule the alternative is made of
+        int rule;
+        /// Index of capture group enclosing the alternative in the combined expression
+        int capture;
+        /// Number of own capture groups of the alternative
+        int captureCount;
+        /// The alternative alone, it's used to scan parts of a block around matched capture groups
+        QRegularExpression expr;
+    };
+    QRegularExpression expr;
+    QVector<Alt> alts;
+};
+
+
 struct Spec
 {
     Meta meta;
     QVector<Rule> rules;
 
+    /// How rules are applied to a text block, set by top-level key `engine`.
+    /// ENGINE_RULES: each rule is matched over the whole block independently,
+    /// later rules override earlier ones unless they are skipped.
+    /// ENGINE_SCANNER: a block is tokenized once via the combined expression,
+    /// where each position is taken by the first matched rule in priority order.
+    enum Engine {ENGINE_RULES, ENGINE_SCANNER};
+    Engine engine = ENGINE_RULES;
+    Scanner scanner;
+
+    /// Plain word terms of all rules mapped to indexes of rules having these terms.
+    /// Terms of rules having the `ignore-case` option are stored lowercased in `wordsNoCase`.
+    /// All terms are found in a single pass over words of a block.
+    QHash<QString, QVector<int>> words;
+    QHash<QString, QVector<int>> wordsNoCase;
+
     // not empty only when spec is loaded withRawData
     // this stuff is required for highlighter editor
     QMap<int, QVariant> raw;
@@ -94,6 +134,10 @@ public:
     QSharedPointer<Spec> loadSpec(const Meta &meta, bool withRawData = false) const override;
     QString saveSpec(const QSharedPointer<Spec>& spec) override;
     QString deleteSpec(const Meta&) override { return QString(); }
+
+    /// Returns a path in the app cache directory where a compiled snapshot
+    /// of the source spec file is stored, or an empty string if there is no cache directory.
+    static QString compiledSpecFileName(const QString& sourceFile);
 private:
     QString _dir;
 };
@@ -126,22 +170,146 @@ struct SpecResult
 SpecWarnings loadSpec(QSharedPointer<Spec>& spec, QString* data, bool withRawData);
 SpecResult createSpecFromFile(const QString& fileName, bool withRawData);
 
+/// Returns a spec loaded from file and shared between all documents highlighted with it.
+/// The file is parsed and its expressions are optimized only once,
+/// it is reloaded when its modification time changes. The least recently used specs
+/// are dropped from the cache when there are too many of them.
+/// Returns null and the reason in `error` if the file can't be loaded.
+/// The function is thread-safe.
+QSharedPointer<const Spec> cachedSpecFromFile(const QString& fileName, QString* error = nullptr);
+
+/// A span of block text to be formatted by a rule
+struct FormatRun
+{
+    int start;
+    int length;
+    int rule;
+};
+
+using FormatRuns = QVector<FormatRun>;
+
+/// Highlighting cost of a rule accumulated over matched blocks.
+/// With the scanner engine all rules are matched by a single expression,
+/// so only matches are counted per rule.
+struct RuleStats
+{
+    qint64 invocations = 0; ///< Number of times the rule expressions were run
+    qint64 matches = 0;     ///< Number of found matches including skipped ones
+    qint64 skipped = 0;     ///< Number of matches dropped because of `skip` keys
+    qint64 nsecs = 0;       ///< Time spent on matching the rule expressions
+};
+
+using RulesStats = QVector<RuleStats>;
+
+/// Finds spans of the text block to be formatted by the spec rules.
+/// Runs are appended in order they should be applied, a later one overrides earlier ones.
+/// Returns the block state which is a continued multiline rule index or -1.
+/// When stats are given, they must be sized to the spec rules and are accumulated.
+int matchBlock(const Spec& spec, const QString &text, int previousState, FormatRuns& runs, RulesStats* stats = nullptr);
+
+/// Returns the same block state as `matchBlock()` but does as little matching as possible.
+int matchBlockState(const Spec& spec, const QString &text, int previousState);
+
+/// Highlights text line by line without QTextDocument, keeping multiline state between lines.
+/// It uses the same matching as `Highlighter`, so results are the same as in an editor.
+/// Tokenizers are independent, so different texts can be processed in parallel threads
+/// even with the same spec.
+class Tokenizer
+{
+public:
+    explicit Tokenizer(const QSharedPointer<const Spec>& spec) : _spec(spec) {}
+
+    /// Returns runs of the line not overlapping each other and ordered by position.
+    /// Where runs of rules overlap, the later applied rule wins as in an editor.
+    /// The result is valid until the next call.
+    const FormatRuns& tokenize(const QString& line);
+
+    /// Starts a new text
+    void reset() { _state = -1; }
+
+    /// Multiline state after the last tokenized line
+    int state() const { return _state; }
+
+    const QSharedPointer<const Spec>& spec() const { return _spec; }
+
+private:
+    QSharedPointer<const Spec> _spec;
+    int _state = -1;
+    FormatRuns _runs, _tokens;
+    QVector<int> _owners;
+};
+
+/// Splits text into lines the same way as QPlainTextEdit does it
+/// and calls the visitor for each line with its tokens.
+void tokenizeText(const QSharedPointer<const Spec>& spec, const QString& text,
+                  const std::function<void(const QString& line, const FormatRuns& tokens)>& visitor);
+
+/// Returns highlighted text as HTML fragment having formatted spans with inline styles,
+/// lines are separated with `\n`, so the fragment should be put into `<pre>` tag.
+/// `Rule::fontSizeDelta` is relative to the font size of the enclosing element.
+QString toHtml(const QSharedPointer<const Spec>& spec, const QString& text);
+
+/// Returns highlighted text with ANSI escape sequences using 24-bit colors.
+/// Terminals can't change font size of a part of text, so `Rule::fontSizeDelta` is ignored.
+QString toAnsi(const QSharedPointer<const Spec>& spec, const QString& text);
+
+struct DeferredState;
+
 class Highlighter : public QSyntaxHighlighter
 {
     Q_OBJECT
 
 public:
-    explicit Highlighter(QTextDocument *parent, const QSharedPointer<Spec>& spec);
-    explicit Highlighter(QPlainTextEdit *parent, const QSharedPointer<Spec>& spec);
+    explicit Highlighter(QTextDocument *parent, const QSharedPointer<const Spec>& spec);
+    explicit Highlighter(QPlainTextEdit *parent, const QSharedPointer<const Spec>& spec);
+    ~Highlighter();
+
+    /// In deferred mode, only blocks visible in the editor are highlighted immediately.
+    /// Other blocks get only their multiline states computed, and they are highlighted
+    /// later in small chunks when the application is idle, visible blocks go first.
+    /// Should be enabled just after construction, then the initial highlighting is deferred too.
+    bool isDeferred() const { return bool(_deferred); }
+    void setDeferred(bool on);
+
+    /// In threaded mode, which implies deferred mode, runs of pending blocks are found
+    /// in a worker thread over a snapshot of the document text and are cached per block.
+    /// Then the highlighter only applies cached runs when they are still valid
+    /// for the block text and the incoming state, and matches visible blocks synchronously.
+    bool isThreaded() const;
+    void setThreaded(bool on);
+
+    /// When profiling is enabled, the highlighter accumulates costs of the spec rules
+    /// for blocks matched in the GUI thread, see `RuleStats`.
+    bool isProfiling() const { return _profiling; }
+    void setProfiling(bool on);
+    const RulesStats& rulesStats() const { return _stats; }
+    void resetRulesStats();
+
+signals:
+    /// Reports progress of deferred highlighting
+    void deferredProgress(int highlightedBlocks, int totalBlocks);
+
+    /// Emitted when deferred highlighting has no more pending blocks
+    void deferredFinished();
 
 protected:
     void highlightBlock(const QString &text);
 
 private:
-    QSharedPointer<Spec> _spec;
+    QSharedPointer<const Spec> _spec;
     QTextDocument* _document;
-
-    int matchMultiline(const QString &text, const Rule& rule, int ruleIndex, int initialOffset);
+    QPlainTextEdit* _editor = nullptr;
+    FormatRuns _runs;
+    std::unique_ptr<DeferredState> _deferred;
+    bool _profiling = false;
+    RulesStats _stats;
+
+    void applyRule(const Rule& rule, const QString &text, int pos, int length);
+    void documentChanged(int position, int charsRemoved, int charsAdded);
+    void updateVisibleBlocks();
+    void processDeferred();
+    void scheduleJob();
+    void startJob();
 };
 
 Highlighter* setHighlighter(QPlainTextEdit* editor, const QString& fileName);
@@ -1,67 +1,31 @@
 #include "OriSpellcheck.h"
 
+#include "tools/OriExtraSelections.h"
 #include "tools/OriSpellcheckEngine.h"
+#include "tools/OriSpellcheckWords.h"
+#include "tools/OriTextEdits.h"
+#include "tools/OriWorkerLink.h"
 
 #include <QActionGroup>
 #include <QApplication>
 #include <QDir>
 #include <QMenu>
 #include <QPlainTextEdit>
+#include <QSharedPointer>
 #include <QTextBlock>
 #include <QTextCodec>
 #include <QTextEdit>
 #include <QTimer>
 
-namespace Ori {
+#include <algorithm>
 
-// Hyperlink made via syntax highlighter doesn't create some 'top level' anchor,
-// so `anchorAt` returns nothing, we have to enumerate styles to find out a href.
-QString hyperlinkAt(const QTextCursor& cursor)
-{
-    int cursorPos = cursor.positionInBlock() - (cursor.position() - cursor.anchor());
-    for (auto& format : cursor.block().layout()->formats())
-        if (format.format.isAnchor() &&
-            cursorPos >= format.start &&
-            cursorPos < format.start + format.length)
-        {
-            auto href = format.format.anchorHref();
-            if (not href.isEmpty()) return href;
-        }
-    return QString();
-}
-
-int selectWordAt(QTextCursor& cursor)
-{
-    // When move cursor to EndOfWord, it stops before bracket, qoute, or punctuation.
-    // But quotes like &raquo; or &rdquo; become a part of the world for some reason.
-    // Remove such punctuation at word boundaries.
-
-    QString word = cursor.selectedText();
-    
-    int length = word.length();
-    int start = 0;
-    int stop = length - 1;
+namespace Ori {
 
-    while (start < length)
-    {
-        auto ch = word.at(start);
-        if (ch.isLetter() || ch.isDigit()) break;
-        start++;
-    }
+namespace {
 
-    while (stop > start)
-    {
-        auto ch = word.at(stop);
-        if (ch.isLetter() || ch.isDigit()) break;
-        stop--;
-    }
+using SpellcheckLink = WorkerLink<SpellcheckWords>;
 
-    length = stop - start + 1;
-    int anchor = cursor.anchor();
-    cursor.setPosition(anchor + start, QTextCursor::MoveAnchor);
-    cursor.setPosition(anchor + start + length, QTextCursor::KeepAnchor);
-    return length;
-}
+} // namespace
 
 //------------------------------------------------------------------------------
 //                               SpellcheckImpl
@@ -72,7 +36,8 @@ class SpellcheckImpl : public QObject
 {
 public:
     explicit SpellcheckImpl(TEditor* editor, SpellcheckEngine* spellchecker) :
-        QObject(editor), _editor(editor), _spellchecker(spellchecker)
+        QObject(editor), _editor(editor), _spellchecker(spellchecker), _marks(ExtraSelections::of(editor)),
+        _edits(editor->document())
     {
         _spellErrorFormat.setUnderlineColor(Qt::red);
         _spellErrorFormat.setUnderlineStyle(QTextCharFormat::SpellCheckUnderline);
@@ -81,7 +46,6 @@ public:
 
         _editor->setContextMenuPolicy(Qt::CustomContextMenu);
         connect(_editor, &TEditor::customContextMenuRequested, this, &SpellcheckImpl::contextMenuRequested);
-        connect(_editor, &TEditor::cursorPositionChanged, this, &SpellcheckImpl::cursorMoved);
         connect(_editor->document(), QOverload<int, int, int>::of(&QTextDocument::contentsChange), this, &SpellcheckImpl::documentChanged);
         
         _timer = new QTimer(this);
@@ -91,6 +55,7 @@ public:
     
     ~SpellcheckImpl()
     {
+        cancelCheck();
         _editor->setContextMenuPolicy(Qt::DefaultContextMenu);
     }
     
@@ -98,32 +63,37 @@ public:
     {
         _spellcheckStart = -1;
         _spellcheckStop = -1;
-        spellcheck();
-        _editor->setExtraSelections(_errorMarks);
+        startCheck();
     }
     
     void clearErrorMarks()
     {
-        _editor->setExtraSelections(QList<QTextEdit::ExtraSelection>());
+        cancelCheck();
+        _marks->clearLayer(ExtraSelections::LAYER_SPELLING);
     }
 
 private:
     TEditor* _editor;
     SpellcheckEngine* _spellchecker = nullptr;
+    ExtraSelections* _marks;
     QTimer* _timer;
     bool _changesLocked = false;
     int _changesStart = -1;
     int _changesStop = -1;
     int _spellcheckStart = -1;
     int _spellcheckStop = -1;
-    bool _isHrefChanged = false;
-    QString _hrefAtCursor;
-    QList<QTextEdit::ExtraSelection> _errorMarks;
     QTextCharFormat _spellErrorFormat;
+    QSharedPointer<SpellcheckLink> _link;
+    QTextCursor _checkRange;
+    int _checkRevision = 0;
+    int _revision = 0;
+    TextEdits _edits;
 
     void documentChanged(int position, int charsRemoved, int charsAdded)
     {
-        Q_UNUSED(charsRemoved)
+        // Only edits of the text make running check outdated
+        if (_edits.changed(charsRemoved, charsAdded))
+            _revision++;
 
         if (_changesLocked) return;
     
@@ -132,112 +102,151 @@ private:
         int stopPos = position + charsAdded;
         if (stopPos > _changesStop) _changesStop = stopPos;
     
-        _isHrefChanged = _isHrefChanged || !_hrefAtCursor.isEmpty();
-    
         _timer->start();
     }
     
     void doSpellcheck()
     {
         _timer->stop();
+
+        // Changes made meanwhile are checked when the running check is finished
+        if (_link) return;
     
-        QTextCursor cursor(_editor->document());
-    
-        // We could insert spaces and split a word in two.
-        // Then we have to check not only the current word but also the previous one.
-        // That's the reason for shifting to -1 from _changesStart position.
-        // But if there is/was a hyperlink in place of changes,
-        // it can contain arbitrary number of words, then it better to check all the block.
-        cursor.setPosition(_changesStart > 0 ? _changesStart - 1 : _changesStart);
-        cursor.movePosition(_isHrefChanged ? QTextCursor::StartOfBlock : QTextCursor::StartOfWord, QTextCursor::MoveAnchor);
-        _spellcheckStart = cursor.position();
-    
-        cursor.setPosition(_changesStop);
-        cursor.movePosition(_isHrefChanged ? QTextCursor::EndOfBlock : QTextCursor::EndOfWord, QTextCursor::KeepAnchor);
-        _spellcheckStop = cursor.position();
-    
-        // Remove marks which are in checking range, they will be recreated on spellcheck
-        QList<QTextEdit::ExtraSelection> errorMarks;
-        for (auto &es : _editor->extraSelections())
-            if (es.cursor.position() < _spellcheckStart ||
-                es.cursor.anchor() >= _spellcheckStop)
-                errorMarks << es;
-    
-        spellcheck();
-    
-        errorMarks.append(_errorMarks);
-        _editor->setExtraSelections(errorMarks);
-    
-        _spellcheckStart = -1;
-        _spellcheckStop = -1;
+        // Whole blocks around changes are checked, so it doesn't matter
+        // if we've split a word in two or there is/was a hyperlink with arbitrary number of words
+        _spellcheckStart = _changesStart;
+        _spellcheckStop = _changesStop;
+
         _changesStart = -1;
         _changesStop = -1;
+
+        startCheck();
     }
 
-    void spellcheck()
+    /// Takes blocks in the checking range and checks their words in the worker thread of the engine
+    void startCheck()
     {
-        _errorMarks.clear();
-    
-        QTextCursor cursor(_editor->document());
-    
-        if (_spellcheckStart > -1) cursor.setPosition(_spellcheckStart);
-    
-        while ((_spellcheckStop < 0 || cursor.position() < _spellcheckStop) && !cursor.atEnd())
+        cancelCheck();
+
+        auto blocks = collectBlocks();
+
+        // The range is tracked by the cursor so it's still known if the document gets changed while checking
+        _checkRange = QTextCursor(_editor->document());
+        if (!blocks.isEmpty())
         {
-            cursor.movePosition(QTextCursor::EndOfWord, QTextCursor::KeepAnchor);
-            int length = selectWordAt(cursor);
-    
-            // When we've skipped punctuation and there is no word,
-            // the cursor may be at the beginning of the next word already.
-            // For example, have text "(word1) word2",
-            // the bracket "(" is treated by QTextEdit as a separate word.
-            // After skipping it, we become at the "w" of "word1" - at the next word after the bracket!
-            // Then moving to `NextWord` shifts the cursor to "word2", and "word1" gets missed.
-            // To avoid, try to find the end of a (possible current) word after skipping punctuation.
-            if (length == 0)
-            {
-                cursor.movePosition(QTextCursor::EndOfWord, QTextCursor::KeepAnchor);
-                length = selectWordAt(cursor);
-            }
-    
-            // Skip one-letter words
-            //
-            // TODO: currently, abbreviations such as "e.i.", "e.g.", "т.д.", "т.п."
-            // are splitted to series of one-letter words and therefore skipped.
-            // It allows mixing of such words in different languages,
-            // e.g. one can use "т.д." in a text in English, it's not ok.
-            //
-            // Similar issue with words like "doesn't" - it splitted into "doesn" and "t",
-            // "t" is skipped and "doesn" gives spelling error. Checking is ok when
-            // true apostrophe character is used (’ = U+2019). But it's not the case
-            // when one type memos via keyboard - single quote is generally used as apostrophe.
-            //
-            // It'd be better to check such words as a whole.
-            //
-            if (length > 1 && hyperlinkAt(cursor).isEmpty())
+            const auto& last = blocks.last();
+            _checkRange.setPosition(blocks.first().pos);
+            _checkRange.setPosition(last.pos + last.text.size(), QTextCursor::KeepAnchor);
+        }
+        _checkRevision = _revision;
+        _spellcheckStart = -1;
+        _spellcheckStop = -1;
+
+        QSharedPointer<SpellcheckLink> link(new SpellcheckLink);
+        link->post = [this, l = link.data()](const SpellcheckWords& errors){
+            QMetaObject::invokeMethod(this, [this, l, errors]{
+                if (_link.data() != l)
+                    return;
+                _link.reset();
+                checkFinished(errors);
+            }, Qt::QueuedConnection);
+        };
+        _link = link;
+
+        auto engine = _spellchecker;
+        engine->startTask([engine, link, blocks]{
+            SpellcheckWords errors;
+            for (int i = 0; i < blocks.size(); i++)
             {
-                QString word = cursor.selectedText();
-    
-                if (!_spellchecker->check(word))
-                    _errorMarks << QTextEdit::ExtraSelection {cursor, _spellErrorFormat};
+                if ((i & 0xFF) == 0 && link->isCancelled())
+                    return;
+                scanWords(blocks.at(i), [engine, &errors](int pos, int length, const QString& word){
+                    if (!engine->checkInWorker(word))
+                        errors << SpellcheckWord {pos, length, word};
+                });
             }
-    
-            cursor.movePosition(QTextCursor::NextWord, QTextCursor::MoveAnchor);
+            link->deliver(errors);
+        });
+    }
+
+    void cancelCheck()
+    {
+        if (!_link) return;
+        _link->cancel();
+        _link.reset();
+    }
+
+    void checkFinished(const SpellcheckWords& errors)
+    {
+        int start = _checkRange.selectionStart();
+        int stop = _checkRange.selectionEnd();
+        _checkRange = QTextCursor();
+
+        // Positions of found errors are not valid anymore,
+        // so the range is checked again along with changes made meanwhile
+        if (_checkRevision != _revision)
+        {
+            if (_changesStart < 0 || start < _changesStart) _changesStart = start;
+            if (stop > _changesStop) _changesStop = stop;
+            _timer->start();
+            return;
+        }
+
+        // Remove marks which are in checking range, they are recreated from results
+        QList<QTextEdit::ExtraSelection> errorMarks;
+        for (auto &es : _marks->layer(ExtraSelections::LAYER_SPELLING))
+            if (es.cursor.position() < start ||
+                es.cursor.anchor() >= stop)
+                errorMarks << es;
+
+        QTextCursor cursor(_editor->document());
+        for (const auto& word : errors)
+        {
+            // A word could be ignored while checking, verdicts of found errors are cached, so it's cheap
+            if (_spellchecker->check(word.text))
+                continue;
+            cursor.setPosition(word.pos);
+            cursor.setPosition(word.pos + word.length, QTextCursor::KeepAnchor);
+            errorMarks << QTextEdit::ExtraSelection {cursor, _spellErrorFormat};
         }
+        _marks->setLayer(ExtraSelections::LAYER_SPELLING, errorMarks);
+
+        if (_changesStart > -1)
+            _timer->start();
     }
-    
-    void cursorMoved()
+
+    SpellcheckBlocks collectBlocks() const
     {
-        _hrefAtCursor = hyperlinkAt(_editor->textCursor());
+        SpellcheckBlocks blocks;
+
+        auto doc = _editor->document();
+        auto block = _spellcheckStart > -1 ? doc->findBlock(_spellcheckStart) : doc->begin();
+        auto last = _spellcheckStop > -1 ? doc->findBlock(_spellcheckStop) : doc->lastBlock();
+        for (; block.isValid(); block = block.next())
+        {
+            SpellcheckBlock snapshot {block.position(), block.text(), {}};
+
+            // Hyperlink made via syntax highlighter doesn't create some 'top level' anchor,
+            // so we have to enumerate styles to find out hrefs.
+            for (const auto& format : block.layout()->formats())
+                if (format.format.isAnchor() && !format.format.anchorHref().isEmpty())
+                    snapshot.links << qMakePair(format.start, format.start + format.length);
+            std::sort(snapshot.links.begin(), snapshot.links.end());
+
+            blocks << snapshot;
+            if (block == last) break;
+        }
+
+        return blocks;
     }
 
     void wordIgnored(const QString& word)
     {
         QList<QTextEdit::ExtraSelection> errorMarks;
-        for (auto &es : _editor->extraSelections())
+        for (auto &es : _marks->layer(ExtraSelections::LAYER_SPELLING))
             if (es.cursor.selectedText() != word)
                 errorMarks << es;
-        _editor->setExtraSelections(errorMarks);
+        _marks->setLayer(ExtraSelections::LAYER_SPELLING, errorMarks);
     }
     
     void contextMenuRequested(const QPoint &pos)
@@ -256,7 +265,7 @@ private:
     {
         auto cursor = _editor->cursorForPosition(_editor->viewport()->mapFromParent(pos));
         auto cursorPos = cursor.position();
-        for (auto &es : _editor->extraSelections())
+        for (auto &es : _marks->layer(ExtraSelections::LAYER_SPELLING))
             if (cursorPos >= es.cursor.anchor() && cursorPos <= es.cursor.position())
                 return es.cursor;
         return QTextCursor();
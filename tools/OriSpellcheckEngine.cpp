@@ -7,6 +7,7 @@
 #include <QApplication>
 #include <QDir>
 #include <QRegularExpression>
+#include <QRunnable>
 #include <QTextCodec>
 
 namespace Ori {
@@ -14,6 +15,20 @@ namespace Ori {
 namespace  {
 static const QString dictFileExt(".dic");
 static const QString affixFileExt(".aff");
+// Vocabulary of a large document is a few tens of thousands of words
+static const int maxVerdicts = 100000;
+
+// QThreadPool can start functions only since Qt 5.15
+class SpellcheckTask : public QRunnable
+{
+public:
+    std::function<void()> task;
+
+    void run() override
+    {
+        task();
+    }
+};
 }
 
 static QDir dictionaryDir()
@@ -144,25 +159,99 @@ SpellcheckEngine::SpellcheckEngine(const QString &dictFilePath, const QString& a
     _hunspell = new Hunspell(affixFilePath.toLocal8Bit().constData(),
                              dictFilePath.toLocal8Bit().constData());
 
-    loadUserDictionary();
+    loadUserDictionary(_hunspell);
+
+    // Hunspell is not thread-safe, so the worker gets its own instance, it's loaded by the first task.
+    // Having a single thread, the worker runs tasks in order, so all the next ones see the instance.
+    _worker.setMaxThreadCount(1);
+    startTask([this, dictFilePath, affixFilePath]{
+        _workerHunspell = new Hunspell(affixFilePath.toLocal8Bit().constData(),
+                                       dictFilePath.toLocal8Bit().constData());
+        loadUserDictionary(_workerHunspell);
+    });
 }
 
 SpellcheckEngine::~SpellcheckEngine()
 {
+    _worker.clear();
+    _worker.waitForDone();
+    if (_workerHunspell) delete _workerHunspell;
     if (_hunspell) delete _hunspell;
 }
 
 bool SpellcheckEngine::check(const QString &word) const
 {
-    return _hunspell->spell(_codec->fromUnicode(word).toStdString());
+    // Words are ignored in the GUI thread too, so the GUI instance always knows them
+    return cachedCheck(_hunspell, word, -1);
+}
+
+bool SpellcheckEngine::checkInWorker(const QString &word)
+{
+    return cachedCheck(_workerHunspell, word, _taskGeneration);
+}
+
+// Verdicts made by a task started before a word was ignored are not stored,
+// because the worker instance learns the word only in the next task.
+// The generation is -1 when verdicts of the current generation are made.
+bool SpellcheckEngine::cachedCheck(Hunspell* hunspell, const QString &word, int generation) const
+{
+    QMutexLocker locker(&_verdictsMutex);
+    auto it = _verdicts.constFind(word);
+    if (it != _verdicts.constEnd())
+        return it.value();
+    if (generation < 0)
+        generation = _verdictsGeneration;
+    locker.unlock();
+
+    bool ok = hunspell->spell(_codec->fromUnicode(word).toStdString());
+
+    locker.relock();
+    if (generation == _verdictsGeneration)
+    {
+        if (_verdicts.size() >= maxVerdicts)
+            _verdicts.clear();
+        _verdicts.insert(word, ok);
+    }
+    return ok;
+}
+
+void SpellcheckEngine::dropVerdicts()
+{
+    QMutexLocker locker(&_verdictsMutex);
+    _verdicts.clear();
+    _verdictsGeneration++;
+}
+
+void SpellcheckEngine::startTask(const std::function<void()>& task)
+{
+    QMutexLocker locker(&_verdictsMutex);
+    int generation = _verdictsGeneration;
+    locker.unlock();
+    auto runnable = new SpellcheckTask;
+    runnable->task = [this, task, generation]{
+        _taskGeneration = generation;
+        task();
+    };
+    _worker.start(runnable);
 }
 
 void SpellcheckEngine::ignore(const QString &word)
 {
     _hunspell->add(_codec->fromUnicode(word).toStdString());
+    // Hunspell accepts the added word in other capitalizations too,
+    // so it's not enough to update only the verdict of the word itself.
+    // Tasks started before are of the previous generation, so they can't store verdicts
+    // made by the worker instance not knowing the word yet.
+    dropVerdicts();
+    startTask([this, word]{
+        if (_workerHunspell)
+            _workerHunspell->add(_codec->fromUnicode(word).toStdString());
+    });
     emit wordIgnored(word);
 }
 
+// The word is only stored for next sessions, it's accepted in the current one after `ignore()`,
+// so cached verdicts are still valid here
 void SpellcheckEngine::save(const QString &word)
 {
     if (_userDictionaryPath.isEmpty()) return;
@@ -193,7 +282,7 @@ QStringList SpellcheckEngine::suggest(const QString &word) const
     return variants;
 }
 
-void SpellcheckEngine::loadUserDictionary()
+void SpellcheckEngine::loadUserDictionary(Hunspell* hunspell)
 {
     if (_userDictionaryPath.isEmpty()) return;
 
@@ -213,7 +302,7 @@ void SpellcheckEngine::loadUserDictionary()
     stream.setCodec("UTF-8");
 #endif
     for (QString word = stream.readLine(); !word.isEmpty(); word = stream.readLine())
-        _hunspell->add(_codec->fromUnicode(word).toStdString());
+        hunspell->add(_codec->fromUnicode(word).toStdString());
     file.close();
 }
 
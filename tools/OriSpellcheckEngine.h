@@ -1,7 +1,12 @@
 #ifndef ORI_SPELLCHECK_ENGINE_H
 #define ORI_SPELLCHECK_ENGINE_H
 
+#include <QHash>
+#include <QMutex>
 #include <QObject>
+#include <QThreadPool>
+
+#include <functional>
 
 QT_BEGIN_NAMESPACE
 class QTextCodec;
@@ -21,8 +26,19 @@ public:
     ~SpellcheckEngine();
 
     const QString& lang() const { return _lang; }
+
+    /// Verdicts are cached, so words repeated in a text are passed to Hunspell only once.
+    /// The cache is bounded and is dropped when a word gets ignored.
     bool check(const QString &word) const;
     void ignore(const QString &word);
+
+    /// Runs the task in the worker thread of the engine, tasks are run one by one in order they are started.
+    /// The worker thread has its own Hunspell instance, so checking there never blocks the GUI thread.
+    void startTask(const std::function<void()>& task);
+
+    /// Does the same as `check()` but may only be called from tasks run by `startTask()`
+    bool checkInWorker(const QString &word);
+
     void save(const QString &word);
     QStringList suggest(const QString &word) const;
     
@@ -38,9 +54,18 @@ private:
     QString _lang;
     QString _userDictionaryPath;
     Hunspell* _hunspell = nullptr;
+    Hunspell* _workerHunspell = nullptr;
+    QThreadPool _worker;
     QTextCodec *_codec;
+    mutable QHash<QString, bool> _verdicts;
+    mutable QMutex _verdictsMutex;
+    int _verdictsGeneration = 0;
+    /// Generation of verdicts when the running worker task was started, it's accessed only by the worker
+    int _taskGeneration = 0;
 
-    void loadUserDictionary();
+    bool cachedCheck(Hunspell* hunspell, const QString &word, int generation) const;
+    void dropVerdicts();
+    void loadUserDictionary(Hunspell* hunspell);
 };
 
 } // namespace Ori
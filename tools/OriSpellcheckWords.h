@@ -0,0 +1,77 @@
+#ifndef ORI_SPELLCHECK_WORDS_H
+#define ORI_SPELLCHECK_WORDS_H
+
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+namespace Ori {
+
+struct SpellcheckWord
+{
+    int pos;
+    int length;
+    QString text;
+};
+
+using SpellcheckWords = QVector<SpellcheckWord>;
+
+/// Snapshot of a text block taken in the GUI thread, words are extracted from it in the worker thread
+struct SpellcheckBlock
+{
+    int pos;
+    QString text;
+    /// Start and stop positions of hyperlinks in the block, ordered by start
+    QVector<QPair<int, int>> links;
+};
+
+using SpellcheckBlocks = QVector<SpellcheckBlock>;
+
+/// Calls the visitor for each word of the block except of words in hyperlinks and one-letter words.
+/// The visitor gets the position of a word in the document, its length and text.
+/// An apostrophe between letters is a part of the word, so "doesn't" is checked as a whole.
+///
+/// TODO: abbreviations such as "e.g.", "т.д.", "т.п." are splitted to series of one-letter words
+/// and therefore skipped. It allows mixing of such words in different languages,
+/// e.g. one can use "т.д." in a text in English, it's not ok.
+///
+template <typename Visitor>
+void scanWords(const SpellcheckBlock& block, Visitor visit)
+{
+    auto isWordChar = [](const QChar& c){ return c.isLetterOrNumber() || c.isMark(); };
+    auto isApostrophe = [](const QChar& c){ return c == '\'' || c == QChar(0x2019); };
+
+    const QChar* text = block.text.constData();
+    const int size = block.text.size();
+    int link = 0;
+    int i = 0;
+    while (i < size)
+    {
+        if (!isWordChar(text[i]))
+        {
+            i++;
+            continue;
+        }
+        int start = i++;
+        while (i < size)
+        {
+            if (isWordChar(text[i]))
+                i++;
+            else if (isApostrophe(text[i]) && i+1 < size && text[i-1].isLetter() && text[i+1].isLetter())
+                i += 2;
+            else
+                break;
+        }
+        if (i - start < 2)
+            continue;
+        while (link < block.links.size() && block.links.at(link).second <= start)
+            link++;
+        if (link < block.links.size() && block.links.at(link).first < i)
+            continue;
+        visit(block.pos + start, i - start, QString(text + start, i - start));
+    }
+}
+
+} // namespace Ori
+
+#endif // ORI_SPELLCHECK_WORDS_H
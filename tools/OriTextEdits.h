@@ -0,0 +1,43 @@
+#ifndef ORI_TEXT_EDITS_H
+#define ORI_TEXT_EDITS_H
+
+#include <QTextDocument>
+
+namespace Ori {
+
+/**
+
+Tells text edits from format changes reported by `QTextDocument::contentsChange()`.
+
+Highlighters change only formats and report it as the same number of chars removed and added,
+and the document revision is not incremented then. Such changes don't make outdated
+results of searching or checking the text.
+
+*/
+class TextEdits
+{
+public:
+    explicit TextEdits(const QTextDocument* doc) : _doc(doc), _revision(doc->revision()) {}
+
+    /// Should be called for each change of the document,
+    /// returns true if the text has been edited since the previous call or `reset()`
+    bool changed(int charsRemoved, int charsAdded)
+    {
+        int revision = _doc->revision();
+        if (charsRemoved == charsAdded && revision == _revision)
+            return false;
+        _revision = revision;
+        return true;
+    }
+
+    /// Takes the current text as unchanged
+    void reset() { _revision = _doc->revision(); }
+
+private:
+    const QTextDocument* _doc;
+    int _revision;
+};
+
+} // namespace Ori
+
+#endif // ORI_TEXT_EDITS_H
@@ -0,0 +1,58 @@
+#ifndef ORI_WORKER_LINK_H
+#define ORI_WORKER_LINK_H
+
+#include <QMutex>
+
+#include <functional>
+
+namespace Ori {
+
+/**
+
+Connects an object living in the GUI thread with a task running in a worker thread.
+
+The link is shared between the object and the task, so the object can be deleted
+while the task is running. The task reports its results via `deliver()`, it calls `post`
+with the link mutex locked, and `post` should send the results to the object via a queued call.
+The object can't be deleted until the call is posted, because it cancels the link in its destructor,
+then the posted call is discarded. The object should also discard posted calls of links
+it has dropped, e.g. by comparing the link captured by `post` with the current one.
+
+*/
+template <typename... Results>
+class WorkerLink
+{
+public:
+    /// Called in the worker thread with the link mutex locked
+    std::function<void(const Results&...)> post;
+
+    void cancel()
+    {
+        QMutexLocker locker(&_mutex);
+        _cancelled = true;
+    }
+
+    bool isCancelled()
+    {
+        QMutexLocker locker(&_mutex);
+        return _cancelled;
+    }
+
+    /// Returns false if the link has been cancelled and the results are not needed anymore
+    bool deliver(const Results&... results)
+    {
+        QMutexLocker locker(&_mutex);
+        if (_cancelled)
+            return false;
+        post(results...);
+        return true;
+    }
+
+private:
+    QMutex _mutex;
+    bool _cancelled = false;
+};
+
+} // namespace Ori
+
+#endif // ORI_WORKER_LINK_H
@@ -0,0 +1,293 @@
+#include "tools/OriHighlighter.h"
+#include "widgets/OriCodeEditor.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QKeyEvent>
+#include <QScrollBar>
+#include <QTextBlock>
+#include <QTextStream>
+
+#include <algorithm>
+#include <functional>
+
+using Ori::Widgets::CodeEditor;
+
+//------------------------------------------------------------------------------
+//                                  Documents
+//------------------------------------------------------------------------------
+
+// Python-like code having nested blocks, so the folder and smart enter have something to work on
+static QString generateCode(int lineCount)
+{
+    static const QStringList sample = {
+        "def function_%1(alpha, beta):",
+        "    \"\"\"Computes something useful\"\"\"",
+        "    if alpha > beta:",
+        "        return alpha - beta  # the simple case",
+        "    total = 0",
+        "    for i in range(alpha):",
+        "        total += i * beta",
+        "        if total > 1000:",
+        "            break",
+        "    return total",
+        "",
+    };
+    QStringList lines;
+    lines.reserve(lineCount);
+    int n = 0;
+    while (lines.size() < lineCount)
+    {
+        for (int i = 0; i < sample.size() && lines.size() < lineCount; i++)
+            lines << (i == 0 ? sample.at(i).arg(n) : sample.at(i));
+        n++;
+    }
+    return lines.join('\n');
+}
+
+//------------------------------------------------------------------------------
+//                                  Benchmark
+//------------------------------------------------------------------------------
+
+struct Latencies
+{
+    QVector<qint64> events;
+    QVector<qint64> paints;
+};
+
+class Session
+{
+public:
+    Session(CodeEditor* editor, int eventCount) : editor(editor), eventCount(eventCount) {}
+
+    // Runs the action as a single event, then lets queued work triggered by it to be done,
+    // and repaints the editor synchronously to measure paint time separately
+    void step(const std::function<void()>& action)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        action();
+        QCoreApplication::processEvents();
+        _latencies.events << timer.nsecsElapsed();
+
+        timer.restart();
+        editor->repaint();
+        _latencies.paints << timer.nsecsElapsed();
+    }
+
+    void key(int key, const QString& text = QString(), Qt::KeyboardModifiers mods = Qt::NoModifier)
+    {
+        step([this, key, text, mods]{
+            QKeyEvent press(QEvent::KeyPress, key, mods, text);
+            QApplication::sendEvent(editor, &press);
+            QKeyEvent release(QEvent::KeyRelease, key, mods, text);
+            QApplication::sendEvent(editor, &release);
+        });
+    }
+
+    void moveTo(int blockNumber, bool toEnd = false)
+    {
+        QTextCursor cursor(editor->document()->findBlockByNumber(blockNumber));
+        if (toEnd) cursor.movePosition(QTextCursor::EndOfBlock);
+        editor->setTextCursor(cursor);
+        editor->centerCursor();
+        QCoreApplication::processEvents();
+    }
+
+    int middleLine() const { return editor->blockCount() / 2; }
+
+    // Finds a line starting a code block near the middle of the document
+    int blockStartLine() const
+    {
+        auto block = editor->document()->findBlockByNumber(middleLine());
+        while (block.isValid() && !block.text().endsWith(':'))
+            block = block.next();
+        return block.isValid() ? block.blockNumber() : 0;
+    }
+
+    Latencies take() { auto res = _latencies; _latencies = {}; return res; }
+
+    CodeEditor* const editor;
+    const int eventCount;
+
+private:
+    Latencies _latencies;
+};
+
+struct Scenario
+{
+    QString name;
+    std::function<void(Session&)> run;
+};
+
+static QVector<Scenario> scenarios()
+{
+    return {
+        { "typing", [](Session& s){
+            s.moveTo(s.middleLine(), true);
+            const QString text = " value = alpha + beta";
+            for (int i = 0; i < s.eventCount; i++)
+            {
+                QChar c = text.at(i % text.size());
+                s.key(c == ' ' ? Qt::Key_Space : Qt::Key_A, c);
+            }
+        }},
+        { "smart_enter", [](Session& s){
+            s.moveTo(s.blockStartLine(), true);
+            for (int i = 0; i < s.eventCount; i++)
+                s.key(Qt::Key_Return, "\r");
+        }},
+        { "paste", [](Session& s){
+            s.moveTo(s.middleLine());
+            const QString text = generateCode(50) + '\n';
+            for (int i = 0; i < s.eventCount / 10; i++)
+                s.step([&s, &text]{ s.editor->insertPlainText(text); });
+        }},
+        { "select_all_indent", [](Session& s){
+            for (int i = 0; i < qMax(1, s.eventCount / 50); i++)
+            {
+                s.editor->selectAll();
+                s.step([&s]{ s.editor->indentSelection(); });
+                s.step([&s]{ s.editor->unindentSelection(); });
+            }
+        }},
+        { "scrolling", [](Session& s){
+            auto bar = s.editor->verticalScrollBar();
+            bar->setValue(0);
+            const int step = qMax(1, bar->maximum() / s.eventCount);
+            for (int i = 0; i < s.eventCount; i++)
+                s.step([bar, step]{ bar->setValue(bar->value() + step); });
+        }},
+        { "folding", [](Session& s){
+            s.editor->setFoldingType(CodeEditor::FOLD_PYTHON);
+            int line = s.blockStartLine();
+            for (int i = 0; i < s.eventCount / 2; i++)
+            {
+                s.moveTo(line);
+                s.step([&s]{ s.editor->fold(); });
+                s.step([&s]{ s.editor->unfold(); });
+            }
+            s.step([&s]{ s.editor->foldAll(); });
+            s.step([&s]{ s.editor->unfoldAll(); });
+            s.editor->setFoldingType(CodeEditor::FOLD_NONE);
+        }},
+    };
+}
+
+static double percentile(QVector<qint64> values, double p)
+{
+    if (values.isEmpty()) return 0;
+    std::sort(values.begin(), values.end());
+    int index = qBound(0, int(p * (values.size() - 1) + 0.5), int(values.size() - 1));
+    return values.at(index) / 1e3;
+}
+
+static QJsonObject stats(const QVector<qint64>& values)
+{
+    QJsonObject r;
+    r["p50_us"] = percentile(values, 0.5);
+    r["p90_us"] = percentile(values, 0.9);
+    r["p99_us"] = percentile(values, 0.99);
+    r["max_us"] = percentile(values, 1);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    // The benchmark doesn't need a display
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app(argc, argv);
+    app.setApplicationName("editor_bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures responsiveness of the code editor in scripted sessions");
+    parser.addHelpOption();
+    QCommandLineOption optLines("lines", "Comma separated sizes of generated documents in lines.", "counts",
+        "1000,10000,100000");
+    QCommandLineOption optEvents("events", "Number of events per scenario.", "count", "200");
+    QCommandLineOption optScenarios("scenario", "Scenario to run, can be repeated. All scenarios by default.", "name");
+    QCommandLineOption optSyntax("syntax", "Attach highlighter with this *.ohl spec.", "file");
+    QCommandLineOption optOutput("output", "Write JSON results to this file instead of stdout.", "file");
+    parser.addOptions({optLines, optEvents, optScenarios, optSyntax, optOutput});
+    parser.process(app);
+
+    QVector<int> lineCounts;
+    for (const auto& s : parser.value(optLines).split(','))
+    {
+        int count = s.trimmed().toInt();
+        if (count > 0) lineCounts << count;
+    }
+    const int eventCount = qMax(10, parser.value(optEvents).toInt());
+    const QStringList selected = parser.values(optScenarios);
+
+    QJsonArray results;
+    QTextStream log(stderr);
+    for (int lineCount : std::as_const(lineCounts))
+    {
+        const QString code = generateCode(lineCount);
+        for (const auto& scenario : scenarios())
+        {
+            if (!selected.isEmpty() && !selected.contains(scenario.name))
+                continue;
+
+            // Each scenario gets a fresh editor, so they don't affect each other
+            CodeEditor editor;
+            editor.resize(1000, 800);
+            editor.show();
+            if (parser.isSet(optSyntax))
+                Ori::Highlighter::setHighlighter(&editor, parser.value(optSyntax));
+            QElapsedTimer timer;
+            timer.start();
+            editor.setCode(code);
+            QCoreApplication::processEvents();
+            editor.repaint();
+            const qint64 loadNs = timer.nsecsElapsed();
+
+            Session session(&editor, eventCount);
+            scenario.run(session);
+            auto latencies = session.take();
+
+            QJsonObject r;
+            r["scenario"] = scenario.name;
+            r["lines"] = lineCount;
+            r["events"] = latencies.events.size();
+            r["load_ms"] = loadNs / 1e6;
+            r["event"] = stats(latencies.events);
+            r["paint"] = stats(latencies.paints);
+            results << r;
+
+            log << scenario.name << ", " << lineCount << " lines: event p50 "
+                << r["event"].toObject()["p50_us"].toDouble() << " us, p99 "
+                << r["event"].toObject()["p99_us"].toDouble() << " us, paint p50 "
+                << r["paint"].toObject()["p50_us"].toDouble() << " us" << Qt::endl;
+        }
+    }
+
+    QJsonObject report;
+    report["qt"] = QString(qVersion());
+    report["platform"] = QApplication::platformName();
+    report["results"] = results;
+    auto json = QJsonDocument(report).toJson();
+
+    if (parser.isSet(optOutput))
+    {
+        QFile file(parser.value(optOutput));
+        if (!file.open(QFile::WriteOnly | QFile::Truncate) || file.write(json) < 0)
+        {
+            qCritical() << "Unable to write" << file.fileName() << file.errorString();
+            return 1;
+        }
+    }
+    else
+        QTextStream(stdout) << json;
+
+    return 0;
+}
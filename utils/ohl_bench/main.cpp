@@ -0,0 +1,278 @@
+#include "tools/OriHighlighter.h"
+
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+
+#include <atomic>
+#include <cerrno>
+
+using namespace Ori::Highlighter;
+
+//------------------------------------------------------------------------------
+//                             Allocation counting
+//------------------------------------------------------------------------------
+
+// Qt containers allocate via malloc rather than operator new, so count calls of all
+// allocating functions of libc, operator new ends up in malloc too.
+// Functions defined in the executable take precedence over libc ones for the whole process.
+#if defined(__GLIBC__)
+#define COUNT_ALLOCATIONS
+
+static std::atomic<qint64> allocations{0};
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void* p = __libc_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+static qint64 allocationCount() { return allocations.load(std::memory_order_relaxed); }
+#else
+static qint64 allocationCount() { return 0; }
+#endif
+
+//------------------------------------------------------------------------------
+//                                  Benchmark
+//------------------------------------------------------------------------------
+
+struct Corpus
+{
+    QString name;
+    QStringList lines;
+    qint64 chars = 0;
+};
+
+struct Result
+{
+    qint64 nsecs = 0;
+    qint64 allocations = 0;
+};
+
+// Repeats sample text of the spec to get the required number of lines
+static Corpus generateCorpus(const QStringList& sample, int lineCount)
+{
+    Corpus corpus;
+    corpus.name = QString("sample x %1").arg(lineCount);
+    corpus.lines.reserve(lineCount);
+    while (corpus.lines.size() < lineCount)
+        for (int i = 0; i < sample.size() && corpus.lines.size() < lineCount; i++)
+        {
+            corpus.lines << sample.at(i);
+            corpus.chars += sample.at(i).size();
+        }
+    return corpus;
+}
+
+static Corpus loadCorpus(const QString& fileName)
+{
+    Corpus corpus;
+    corpus.name = QFileInfo(fileName).fileName();
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly | QFile::Text))
+    {
+        qWarning() << "Unable to open corpus" << fileName << file.errorString();
+        return corpus;
+    }
+    QTextStream stream(&file);
+    while (!stream.atEnd())
+    {
+        corpus.lines << stream.readLine();
+        corpus.chars += corpus.lines.last().size();
+    }
+    return corpus;
+}
+
+// Highlights lines the same way as Highlighter::highlightBlock() does,
+// passing the state of a block to the next one
+static Result highlight(const Spec& spec, const Corpus& corpus)
+{
+    FormatRuns runs;
+    int state = -1;
+    qint64 allocs = allocationCount();
+    QElapsedTimer timer;
+    timer.start();
+    for (const auto& line : corpus.lines)
+    {
+        runs.clear();
+        state = matchBlock(spec, line, state, runs);
+    }
+    Result res;
+    res.nsecs = timer.nsecsElapsed();
+    res.allocations = allocationCount() - allocs;
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    // Formats of rules need only the gui module, so no display is required
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+    app.setApplicationName("ohl_bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures highlighting throughput of syntax specs");
+    parser.addHelpOption();
+    QCommandLineOption optSyntaxDir("syntax-dir", "Directory containing *.ohl specs.", "dir",
+        app.applicationDirPath() + "/../syntax");
+    QCommandLineOption optSpecs("spec", "Spec name to benchmark, can be repeated. All specs by default.", "name");
+    QCommandLineOption optLines("lines", "Comma separated sizes of generated corpora in lines.", "counts",
+        "10000,100000,1000000");
+    QCommandLineOption optCorpus("corpus", "Highlight this file instead of generated corpora.", "file");
+    QCommandLineOption optRepeat("repeat", "Number of runs, the best one is reported.", "count", "3");
+    QCommandLineOption optOutput("output", "Write JSON results to this file instead of stdout.", "file");
+    parser.addOptions({optSyntaxDir, optSpecs, optLines, optCorpus, optRepeat, optOutput});
+    parser.process(app);
+
+    QDir syntaxDir(parser.value(optSyntaxDir));
+    QStringList specNames = parser.values(optSpecs);
+    if (specNames.isEmpty())
+        for (const auto& fi : syntaxDir.entryInfoList({"*.ohl"}, QDir::Files, QDir::Name))
+            specNames << fi.completeBaseName();
+    if (specNames.isEmpty())
+    {
+        qCritical() << "No specs found in" << syntaxDir.absolutePath();
+        return 1;
+    }
+
+    QVector<int> lineCounts;
+    for (const auto& s : parser.value(optLines).split(','))
+    {
+        int count = s.trimmed().toInt();
+        if (count > 0) lineCounts << count;
+    }
+    const int repeat = qMax(1, parser.value(optRepeat).toInt());
+
+    QJsonArray results;
+    QTextStream log(stderr);
+    for (const auto& specName : std::as_const(specNames))
+    {
+        auto fileName = syntaxDir.filePath(specName + ".ohl");
+        auto spec = cachedSpecFromFile(fileName);
+        if (!spec)
+        {
+            log << "Skip " << specName << ": unable to load spec" << Qt::endl;
+            continue;
+        }
+
+        QVector<Corpus> corpora;
+        if (parser.isSet(optCorpus))
+            corpora << loadCorpus(parser.value(optCorpus));
+        else
+        {
+            auto raw = createSpecFromFile(fileName, true);
+            QStringList sample = raw.spec ? raw.spec->rawSample().split('\n') : QStringList();
+            if (sample.isEmpty() || (sample.size() == 1 && sample.first().isEmpty()))
+            {
+                log << "Skip " << specName << ": spec has no sample text" << Qt::endl;
+                continue;
+            }
+            for (int count : std::as_const(lineCounts))
+                corpora << generateCorpus(sample, count);
+        }
+
+        for (const auto& corpus : std::as_const(corpora))
+        {
+            if (corpus.lines.isEmpty()) continue;
+
+            Result best;
+            for (int i = 0; i < repeat; i++)
+            {
+                auto res = highlight(*spec, corpus);
+                if (i == 0 || res.nsecs < best.nsecs)
+                    best = res;
+            }
+
+            const double blocks = corpus.lines.size();
+            QJsonObject r;
+            r["spec"] = specName;
+            r["engine"] = spec->engine == Spec::ENGINE_SCANNER ? "scanner" : "rules";
+            r["corpus"] = corpus.name;
+            r["lines"] = corpus.lines.size();
+            r["chars"] = corpus.chars;
+            r["total_ms"] = best.nsecs / 1e6;
+            r["lines_per_sec"] = best.nsecs > 0 ? qRound64(blocks * 1e9 / best.nsecs) : 0;
+            r["ns_per_block"] = best.nsecs / blocks;
+#ifdef COUNT_ALLOCATIONS
+            r["allocs_per_block"] = best.allocations / blocks;
+#else
+            r["allocs_per_block"] = QJsonValue::Null;
+#endif
+            results << r;
+
+            log << specName << ", " << corpus.name << ": "
+                << r["lines_per_sec"].toVariant().toLongLong() << " lines/s, "
+                << QString::number(r["ns_per_block"].toDouble(), 'f', 0) << " ns/block" << Qt::endl;
+        }
+    }
+
+    QJsonObject report;
+    report["qt"] = QString(qVersion());
+    report["repeat"] = repeat;
+    report["results"] = results;
+    auto json = QJsonDocument(report).toJson();
+
+    if (parser.isSet(optOutput))
+    {
+        QFile file(parser.value(optOutput));
+        if (!file.open(QFile::WriteOnly | QFile::Truncate) || file.write(json) < 0)
+        {
+            qCritical() << "Unable to write" << file.fileName() << file.errorString();
+            return 1;
+        }
+    }
+    else
+        QTextStream(stdout) << json;
+
+    return 0;
+}
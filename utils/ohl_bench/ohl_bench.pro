@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# Highlighter throughput benchmark
+#
+#-------------------------------------------------
+
+QT += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++20 console
+CONFIG -= app_bundle
+
+win32-msvc* {
+    QMAKE_CXXFLAGS += /std:c++20
+} 
+
+TARGET = ohl_bench
+TEMPLATE = app
+
+DESTDIR = $$_PRO_FILE_PWD_/../../bin
+
+include("../../orion.pri")
+
+HEADERS +=
+
+SOURCES += \
+    main.cpp
@@ -9,6 +9,7 @@
 #include <QCheckBox>
 #include <QDebug>
 #include <QFileDialog>
+#include <QHeaderView>
 #include <QLabel>
 #include <QListWidget>
 #include <QMainWindow>
@@ -16,8 +17,11 @@
 #include <QPlainTextEdit>
 #include <QPushButton>
 #include <QSplitter>
+#include <QTableWidget>
 #include <QTimer>
 
+#include <numeric>
+
 using namespace Ori::Gui;
 using namespace Ori::Highlighter;
 using namespace Ori::Layouts;
@@ -36,6 +40,10 @@ public:
     QString lastDir;
     QLabel *labelFile = new QLabel("(file not selected)");
     QCheckBox *flagShowSpaces = new QCheckBox("Show spaces");
+    QCheckBox *flagProfile = new QCheckBox("Profile rules");
+    QTableWidget *profileView = new QTableWidget;
+    QWidget *profilePanel;
+    QTimer *profileTimer = new QTimer(this);
 
     MainWindow()
     {
@@ -62,6 +70,25 @@ public:
         connect(butApply, &QPushButton::clicked, this, [this]{ applySpec(false); });
         
         connect(flagShowSpaces, &QCheckBox::stateChanged, this, &MainWindow::toggleShowSpaces);
+        connect(flagProfile, &QCheckBox::toggled, this, &MainWindow::toggleProfile);
+
+        profileView->setColumnCount(5);
+        profileView->setHorizontalHeaderLabels({"Rule", "Calls", "Matches", "Skipped", "Time, ms"});
+        profileView->verticalHeader()->setVisible(false);
+        profileView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        profileView->setSelectionBehavior(QAbstractItemView::SelectRows);
+        auto butResetProfile = new QPushButton("Reset");
+        connect(butResetProfile, &QPushButton::clicked, this, [this]{
+            highlighter->resetRulesStats();
+            showProfile();
+        });
+        profilePanel = LayoutV({
+                                   profileView,
+                                   LayoutH({ Stretch(), butResetProfile }),
+                               }).setMargin(0).makeWidget();
+        profilePanel->setVisible(false);
+        profileTimer->setInterval(500);
+        connect(profileTimer, &QTimer::timeout, this, &MainWindow::showProfile);
 
         auto content = splitterH(
                       LayoutV({
@@ -81,10 +108,11 @@ public:
                                       new QLabel("<b>Sample Text</b>"),
                                       Stretch(),
                                       flagShowSpaces,
+                                      flagProfile,
                                       butApply,
                                   }),
                                   new QLabel("This text will also be stored to highlighter spec file"),
-                                  editorSample
+                                  splitterH(editorSample, profilePanel),
                               }).setMargin(0).makeWidget());
 
         addWidget(content);
@@ -141,6 +169,7 @@ public:
 
         if (highlighter) delete highlighter;
         highlighter = new Highlighter(editorSample, spec);
+        highlighter->setProfiling(flagProfile->isChecked());
 
         labelFile->setText(fn);
     }
@@ -150,6 +179,8 @@ public:
         auto code = editorCode->toPlainText();
         auto warns = loadSpec(spec, &code, withRawData);
         showWarns(warns);
+        if (highlighter->isProfiling())
+            highlighter->resetRulesStats();
         highlighter->rehighlight();
         return warns.isEmpty();
     }
@@ -213,6 +244,57 @@ public:
         option.setFlags(flags);
         doc->setDefaultTextOption(option);
     }
+
+    void toggleProfile()
+    {
+        bool on = flagProfile->isChecked();
+        profilePanel->setVisible(on);
+        highlighter->setProfiling(on);
+        if (on)
+        {
+            highlighter->resetRulesStats();
+            highlighter->rehighlight();
+            showProfile();
+            profileTimer->start();
+        }
+        else profileTimer->stop();
+    }
+
+    void showProfile()
+    {
+        const auto& stats = highlighter->rulesStats();
+        int count = qMin(stats.size(), spec->rules.size());
+
+        // The most expensive rules go first
+        QVector<int> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&stats](int a, int b){ return stats.at(a).nsecs > stats.at(b).nsecs; });
+
+        profileView->setRowCount(count);
+        for (int row = 0; row < count; row++)
+        {
+            int i = order.at(row);
+            const auto& s = stats.at(i);
+            setProfileCell(row, 0, spec->rules.at(i).name);
+            setProfileCell(row, 1, QString::number(s.invocations));
+            setProfileCell(row, 2, QString::number(s.matches));
+            setProfileCell(row, 3, QString::number(s.skipped));
+            setProfileCell(row, 4, QString::number(s.nsecs / 1e6, 'f', 3));
+        }
+    }
+
+    void setProfileCell(int row, int col, const QString& text)
+    {
+        auto item = profileView->item(row, col);
+        if (!item)
+        {
+            item = new QTableWidgetItem;
+            if (col > 0)
+                item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            profileView->setItem(row, col, item);
+        }
+        item->setText(text);
+    }
 };
 
 int main(int argc, char *argv[])
@@ -1,19 +1,95 @@
 #include "OriCodeEditor.h"
 
+#include "../tools/OriWorkerLink.h"
+
 #include <QDebug>
 #include <QFile>
 #include <QKeyEvent>
+#include <QMouseEvent>
+#include <QMutex>
+#include <QPaintEvent>
 #include <QPainter>
+#include <QPointer>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QScrollBar>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QStaticText>
+#include <QSyntaxHighlighter>
 #include <QTextBlock>
 #include <QTextCursor>
 #include <QTextDocumentFragment>
+#include <QTextLayout>
+#include <QThreadPool>
 #include <QToolTip>
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <functional>
+
 Q_DECLARE_METATYPE(QTextDocumentFragment)
 
 #define FOLDED_TEXT_TYPE (QTextFormat::UserObject+2)
 #define FOLDED_TEXT_PROP 2
 
+namespace Ori {
+namespace Widgets {
+
+//------------------------------------------------------------------------------
+//                                BlockData
+//------------------------------------------------------------------------------
+
+/// Per-block data of the editor
+class BlockData : public QTextBlockUserData
+{
+public:
+    ~BlockData()
+    {
+        if (hinted)
+            hinted->remove(this);
+    }
+
+    static BlockData* get(const QTextBlock &block)
+    {
+        return static_cast<BlockData*>(block.userData());
+    }
+
+    static BlockData* obtain(QTextBlock &block)
+    {
+        auto data = get(block);
+        if (!data) {
+            data = new BlockData;
+            block.setUserData(data);
+        }
+        return data;
+    }
+
+    /// Indentation level, -1 for empty lines
+    int indent = -1;
+    /// A position in the line where folding should be inserted, -1 if the line doesn't start a code block
+    int mountPos = -1;
+    /// If the code block started in the line is folded
+    bool folded = false;
+    /// Number of lines following this one in the code block started in it, 0 if there is no block.
+    /// It's relative, so it stays valid when lines are inserted or removed out of the block
+    int foldLength = 0;
+    /// Summary of the line drawn in the minimap, valid until the line is changed
+    int mapIndent = 0;
+    int mapLength = 0;
+    QRgb mapColor = 0;
+    bool mapValid = false;
+    /// Line hint shown in the gutter
+    QString hint;
+    /// Editor's index of blocks having hints, the data stays there until the hint is cleared
+    /// or the block is deleted, so hints can be cleared without scanning the document
+    std::shared_ptr<QSet<BlockData*>> hinted;
+};
+
+} // namespace Widgets
+} // namespace Ori
+
 //------------------------------------------------------------------------------
 //                               Helpers
 //------------------------------------------------------------------------------
@@ -46,6 +122,92 @@ bool hasMultilineSelection(const QTextCursor &cursor)
     return endBlock.blockNumber() > startBlock.blockNumber();
 }
 
+/// Replaces lines starting from the given block with new ones in a single edit, so
+/// the document relayouts the range once instead of once per line. Folded code is stored
+/// as objects in the text, if there are some, only changed lines are replaced one by one
+/// to keep foldings of untouched lines. It should be called inside of an edit block.
+void replaceLines(QTextBlock block, const QStringList &oldLines, const QStringList &newLines)
+{
+    bool hasFoldings = false;
+    for (const auto &line : oldLines)
+        if (line.contains(QChar::ObjectReplacementCharacter)) {
+            hasFoldings = true;
+            break;
+        }
+    if (hasFoldings) {
+        for (int i = 0; i < oldLines.size() && block.isValid(); i++, block = block.next()) {
+            if (oldLines.at(i) == newLines.at(i)) continue;
+            QTextCursor lineCursor(block);
+            lineCursor.select(QTextCursor::LineUnderCursor);
+            lineCursor.insertText(newLines.at(i));
+        }
+        return;
+    }
+    // User data of replaced blocks is dropped with them, and the first block gets data
+    // of the last one, so line hints are carried over by line offset. Other data is
+    // recalculated for changed lines anyway.
+    using Ori::Widgets::BlockData;
+    QMap<int, QString> hints;
+    std::shared_ptr<QSet<BlockData*>> hinted;
+    QTextBlock end = block;
+    for (int i = 0; i < oldLines.size() && end.isValid(); i++) {
+        auto data = BlockData::get(end);
+        if (data && !data->hint.isEmpty()) {
+            hints.insert(i, data->hint);
+            hinted = data->hinted;
+        }
+        if (i == oldLines.size()-1 || !end.next().isValid())
+            break;
+        end = end.next();
+    }
+    int firstNumber = block.blockNumber();
+    auto doc = block.document();
+    QTextCursor cursor(block);
+    cursor.setPosition(end.position() + end.length() - 1, QTextCursor::KeepAnchor);
+    cursor.insertText(newLines.join('\n'));
+    if (hints.isEmpty()) return;
+    block = doc->findBlockByNumber(firstNumber);
+    for (int i = 0; i < newLines.size() && block.isValid(); i++, block = block.next()) {
+        auto hint = hints.value(i);
+        auto data = hint.isEmpty() ? BlockData::get(block) : BlockData::obtain(block);
+        if (!data || data->hint == hint) continue;
+        if (data->hinted)
+            data->hinted->remove(data);
+        data->hint = hint;
+        data->hinted = hint.isEmpty() ? nullptr : hinted;
+        if (data->hinted)
+            data->hinted->insert(data);
+    }
+}
+
+/// Collects lines changed by a transformation and applies them via replaceLines()
+struct LinesEdit
+{
+    QStringList oldLines, newLines;
+    int firstChanged = -1, lastChanged = -1;
+
+    void add(const QString &oldLine, const QString &newLine)
+    {
+        if (oldLine != newLine) {
+            if (firstChanged < 0)
+                firstChanged = oldLines.size();
+            lastChanged = oldLines.size();
+        }
+        oldLines << oldLine;
+        newLines << newLine;
+    }
+
+    bool changed() const { return firstChanged >= 0; }
+
+    void apply(QTextDocument *doc, int startBlock) const
+    {
+        if (!changed()) return;
+        int count = lastChanged - firstChanged + 1;
+        replaceLines(doc->findBlockByNumber(startBlock + firstChanged),
+            oldLines.mid(firstChanged, count), newLines.mid(firstChanged, count));
+    }
+};
+
 struct SelectedRange
 {
     SelectedRange(Ori::Widgets::CodeEditor *editor): editor(editor)
@@ -100,27 +262,33 @@ struct SelectedRange
     
     void modify(std::function<QString(const QString &line)> changeLine)
     {
-        cursor.beginEditBlock();
-        for (int blockNum = startBlock; blockNum <= endBlock; blockNum++) {
-            QTextBlock block = editor->document()->findBlockByNumber(blockNum);
-            if (!block.isValid()) continue;
-            
+        LinesEdit edit;
+        QTextBlock block = editor->document()->findBlockByNumber(startBlock);
+        for (int blockNum = startBlock; blockNum <= endBlock && block.isValid(); blockNum++, block = block.next()) {
             QString line = block.text();
-            if (_skipEmptyLines && isEmpty(line)) continue;
+            if (_skipEmptyLines && isEmpty(line)) {
+                edit.add(line, line);
+                continue;
+            }
             
             QString changedLine = changeLine(line);
-            if (changedLine == line) continue;
+            if (changedLine == line) {
+                edit.add(line, line);
+                continue;
+            }
             
             // For restoring cursor position in single line
             posDiff = changedLine.length() - line.length();
 
-            QTextCursor lineCursor(block);
-            lineCursor.select(QTextCursor::LineUnderCursor);
-            lineCursor.insertText(changedLine);
-
-            _restoreSelection = true;
+            edit.add(line, changedLine);
         }
+        if (!edit.changed())
+            return;
+
+        cursor.beginEditBlock();
+        edit.apply(editor->document(), startBlock);
         cursor.endEditBlock();
+        _restoreSelection = true;
     }
     
     SelectedRange& iter(std::function<void(const QString &line)> iterLine)
@@ -169,54 +337,393 @@ int getIndentLevel(const QString& line, int tabWidth)
     return level;
 }
 
-struct CodeBlock
+/// Writes the file atomically, the target file is replaced only when all the data has been written.
+/// Returns an error message or an empty string.
+QString writeCodeFile(const QString &fileName, const QString &code)
 {
-    /// A position in startLine where the folding should be inserted
-    int mountPos = -1;
-    int startLine = -1;
-    int endLine = -1;
-    bool ok() const { return startLine >= 0 && endLine > startLine; }
-};
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Text))
+        return f.errorString();
+    if (f.write(code.toUtf8()) < 0 || !f.commit())
+        return f.errorString();
+    return QString();
+}
+
+} // namespace
+
+namespace Ori {
+namespace Widgets {
+
+//------------------------------------------------------------------------------
+//                                CodeFolder
+//------------------------------------------------------------------------------
 
-CodeBlock findPythonCodeBlock(QTextBlock &startBlock, int tabWidth)
+class CodeFolder
 {
-    if (!startBlock.isValid())
-        return {};
+public:
+    CodeFolder(CodeEditor *editor): editor(editor)
+    {
+        _docChanged = QObject::connect(editor->document(), &QTextDocument::contentsChange, editor,
+            [this](int pos, int removed, int added){ updateIndex(pos, removed, added); });
+        _blockCount = editor->document()->blockCount();
+        indexBlocks(editor->document()->firstBlock(), QTextBlock());
+    }
+
+    ~CodeFolder()
+    {
+        QObject::disconnect(_docChanged);
+    }
+
+    void foldCodeBlock(CodeEditor::FoldingType foldMode)
+    {
+        Q_UNUSED(foldMode)
     
-    int mountPos = -1;
-    QString line = startBlock.text();
-    for (int i = line.length()-1; i >= 0; i--) {
-        if (line[i] == ' ' || line[i] == '\t')
-            continue;
-        if (line[i] == ':') {
-            mountPos = i+1;
-            break;
+        // TODO: add support for more type of blocks when needed
+        auto block = editor->textCursor().block();
+        if (!foldBlock(block))
+            return;
+        
+        // Position the cursor after the folded block symbol
+        QTextCursor newCursor(editor->document());
+        newCursor.setPosition(block.position() + blockData(block)->mountPos + 1);
+        editor->setTextCursor(newCursor);
+    }
+
+    bool foldBlock(const QTextBlock &block)
+    {
+        auto data = blockData(block);
+        if (!data || data->folded)
+            return false;
+        updateRanges();
+        if (data->foldLength <= 0)
+            return false;
+        QTextBlock endBlock = editor->document()->findBlockByNumber(block.blockNumber() + data->foldLength);
+        foldRange(block.position() + data->mountPos, endBlock.position() + endBlock.length() - 1);
+        return true;
+    }
+
+    /// Folds all outermost code blocks in a single pass and a single undo step
+    void foldAll()
+    {
+        updateRanges();
+        QVector<QPair<int, int>> ranges;
+        int blockNum = 0;
+        auto block = editor->document()->firstBlock();
+        while (block.isValid()) {
+            auto data = blockData(block);
+            if (data && !data->folded && data->foldLength > 0) {
+                int start = block.position() + data->mountPos;
+                // Nested blocks go into the folded fragment
+                int foldEnd = blockNum + data->foldLength;
+                while (blockNum < foldEnd) {
+                    block = block.next();
+                    blockNum++;
+                }
+                ranges << qMakePair(start, block.position() + block.length() - 1);
+            }
+            block = block.next();
+            blockNum++;
         }
+        if (ranges.isEmpty())
+            return;
+        // Going from the end keeps positions of preceding ranges valid
+        QTextCursor cursor(editor->document());
+        cursor.beginEditBlock();
+        for (int i = ranges.size()-1; i >= 0; i--)
+            foldRange(ranges.at(i).first, ranges.at(i).second);
+        cursor.endEditBlock();
     }
-    if (mountPos < 0)
-        return {};
 
-    int startLevel = getIndentLevel(line, tabWidth);
-    int endLine = -1;
-    auto block = startBlock.next();
-    while (block.isValid()) {
-        QString line = block.text();
-        if (isEmpty(line)) {
+    void foldRange(int start, int end)
+    {
+        QTextCursor foldCursor(editor->document());
+        foldCursor.setPosition(start);
+        foldCursor.setPosition(end, QTextCursor::KeepAnchor);
+        foldSelection(foldCursor);
+    }
+
+    void toggleFold(const QTextBlock &block)
+    {
+        auto data = blockData(block);
+        if (!data || data->mountPos < 0)
+            return;
+        if (data->folded)
+            unfoldAt(block.position() + data->mountPos);
+        else
+            foldBlock(block);
+    }
+    
+    void foldSelection(QTextCursor c)
+    {
+        QTextCharFormat f;
+        f.setObjectType(FOLDED_TEXT_TYPE);
+        f.setProperty(FOLDED_TEXT_PROP, QVariant::fromValue(c.selection()));
+        c.insertText(QString(QChar::ObjectReplacementCharacter), f);
+    }
+    
+    void unfold()
+    {
+        auto c = editor->textCursor();
+        if (c.hasSelection())
+            return;
+        
+        auto f = c.charFormat();
+        if (f.objectType() != FOLDED_TEXT_TYPE)
+            return;
+    
+        c.movePosition(c.Left, c.KeepAnchor);
+        c.insertFragment(f.property(FOLDED_TEXT_PROP).value<QTextDocumentFragment>());
+    }
+
+    /// Unfolds all code blocks including nested ones in a single undo step
+    void unfoldAll()
+    {
+        if (_folds.isEmpty())
+            return;
+        QTextCursor cursor(editor->document());
+        cursor.beginEditBlock();
+        // Unfolded fragments can contain nested folds, they are indexed when inserted
+        while (!_folds.isEmpty()) {
+            const auto folds = _folds;
+            for (int i = folds.size()-1; i >= 0; i--)
+                unfoldAt(folds.at(i));
+            if (_folds == folds)
+                break;
+        }
+        cursor.endEditBlock();
+    }
+
+    enum Marker { MARKER_NONE, MARKER_FOLDABLE, MARKER_FOLDED };
+
+    /// Checks only a few blocks following the given one, so it's cheap enough for painting
+    Marker marker(const QTextBlock &block) const
+    {
+        auto data = blockData(block);
+        if (!data || data->mountPos < 0)
+            return MARKER_NONE;
+        if (data->folded)
+            return MARKER_FOLDED;
+        auto next = block.next();
+        while (next.isValid()) {
+            auto nextData = blockData(next);
+            if (nextData && nextData->indent >= 0)
+                return nextData->indent > data->indent ? MARKER_FOLDABLE : MARKER_NONE;
+            next = next.next();
+        }
+        return MARKER_NONE;
+    }
+    
+    bool hasFoldings() const
+    {
+        return !_folds.isEmpty();
+    }
+
+    QString toUnfoldedText() const
+    {
+        QString text = editor->toPlainText();
+        if (_folds.isEmpty())
+            return text;
+        QString result;
+        result.reserve(text.size());
+        int prev = 0;
+        for (int pos : _folds) {
+            if (pos < prev || pos >= text.size()) continue;
+            auto format = formatAt(pos);
+            if (format.objectType() != FOLDED_TEXT_TYPE) continue;
+            result += text.mid(prev, pos - prev);
+            result += format.property(FOLDED_TEXT_PROP).value<QTextDocumentFragment>().toPlainText();
+            prev = pos + 1;
+        }
+        result += text.mid(prev);
+        return result;
+    }
+    
+    CodeEditor *editor;
+
+private:
+    /// Sorted document positions of folded text objects
+    QVector<int> _folds;
+    QMetaObject::Connection _docChanged;
+
+    QTextCharFormat formatAt(int pos) const
+    {
+        QTextCursor cursor(editor->document());
+        cursor.setPosition(pos);
+        cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
+        return cursor.charFormat();
+    }
+
+    /// Lines changed since fold ranges were updated, ranges are recalculated only around them.
+    /// There are no changed lines when the first one is greater than the last one.
+    int _dirtyFirst = 0;
+    int _dirtyLast = -1;
+    int _blockCount = 0;
+    int _tabWidth = 0;
+
+    void markDirty(int first, int last)
+    {
+        if (_dirtyFirst > _dirtyLast) {
+            _dirtyFirst = first;
+            _dirtyLast = last;
+        } else {
+            _dirtyFirst = qMin(_dirtyFirst, first);
+            _dirtyLast = qMax(_dirtyLast, last);
+        }
+    }
+
+    static BlockData* blockData(const QTextBlock &block)
+    {
+        return BlockData::get(block);
+    }
+
+    bool isFold(int pos) const
+    {
+        return std::binary_search(_folds.cbegin(), _folds.cend(), pos);
+    }
+
+    /// Updates indentation of blocks from the first one until the last one inclusive,
+    /// or until the document end if the last block is invalid
+    void indexBlocks(QTextBlock block, QTextBlock last)
+    {
+        if (_tabWidth != editor->tabWidth()) {
+            // Levels of all blocks depend on it, so reindex everything
+            _tabWidth = editor->tabWidth();
+            block = editor->document()->firstBlock();
+            last = QTextBlock();
+            markDirty(0, editor->document()->blockCount() - 1);
+        }
+        while (block.isValid()) {
+            auto data = BlockData::obtain(block);
+            const QString text = block.text();
+            int indent = isEmpty(text) ? -1 : getIndentLevel(text, _tabWidth);
+            int mountPos = -1;
+            bool folded = false;
+            for (int i = text.length()-1; i >= 0; i--) {
+                if (text[i] == ' ' || text[i] == '\t')
+                    continue;
+                if (text[i] == QChar::ObjectReplacementCharacter && !folded && isFold(block.position() + i)) {
+                    folded = true;
+                    continue;
+                }
+                if (text[i] == ':')
+                    mountPos = i+1;
+                break;
+            }
+            data->indent = indent;
+            data->mountPos = mountPos;
+            data->folded = folded;
+            if (block == last)
+                break;
             block = block.next();
-            continue;
         }
-        if (getIndentLevel(line, tabWidth) <= startLevel)
-            break;
-        endLine = block.blockNumber();
-        block = block.next();
     }
-    return { mountPos, startBlock.blockNumber(), endLine };
-}
 
-} // namespace
+    /// Finds ends of code blocks enclosing or started in lines changed since the last time.
+    /// Other code blocks are not affected, because their lengths are relative.
+    void updateRanges()
+    {
+        if (_tabWidth != editor->tabWidth())
+            indexBlocks(editor->document()->firstBlock(), QTextBlock());
+        if (_dirtyFirst > _dirtyLast)
+            return;
+        auto doc = editor->document();
+        const int dirtyLast = qMin(_dirtyLast, doc->blockCount() - 1);
+        auto block = doc->findBlockByNumber(qMin(_dirtyFirst, dirtyLast));
+        _dirtyFirst = 0;
+        _dirtyLast = -1;
+
+        // A preceding line encloses the changed ones when all lines between them are indented more,
+        // nothing can enclose a line without indentation, so there is no need to go back further
+        int minIndent = INT_MAX;
+        for (auto prev = block.previous(); prev.isValid() && minIndent > 0; prev = prev.previous()) {
+            auto data = blockData(prev);
+            if (data && data->indent >= 0 && data->indent < minIndent) {
+                minIndent = data->indent;
+                block = prev;
+            }
+        }
 
-namespace Ori {
-namespace Widgets {
+        struct Start { BlockData *data; int blockNum; int level; };
+        QVector<Start> starts;
+        int blockNum = block.blockNumber();
+        int lastNonEmpty = blockNum;
+        while (block.isValid()) {
+            auto data = blockData(block);
+            if (data && data->indent >= 0) {
+                while (!starts.isEmpty() && starts.last().level >= data->indent) {
+                    auto start = starts.takeLast();
+                    start.data->foldLength = lastNonEmpty - start.blockNum;
+                }
+                // Lines after the changed ones start blocks of the same lengths as before
+                if (blockNum > dirtyLast && starts.isEmpty())
+                    break;
+                data->foldLength = 0;
+                if (data->mountPos >= 0 && !data->folded)
+                    starts << Start{data, blockNum, data->indent};
+                lastNonEmpty = blockNum;
+            } else if (data)
+                data->foldLength = 0;
+            block = block.next();
+            blockNum++;
+        }
+        for (const auto& start : std::as_const(starts))
+            start.data->foldLength = lastNonEmpty - start.blockNum;
+    }
+
+    void unfoldAt(int pos)
+    {
+        auto format = formatAt(pos);
+        if (format.objectType() != FOLDED_TEXT_TYPE)
+            return;
+        QTextCursor cursor(editor->document());
+        cursor.setPosition(pos);
+        cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
+        cursor.insertFragment(format.property(FOLDED_TEXT_PROP).value<QTextDocumentFragment>());
+    }
+
+    void updateIndex(int pos, int removed, int added)
+    {
+        // Folds inside of the changed range are dropped, following ones are shifted
+        auto first = std::lower_bound(_folds.begin(), _folds.end(), pos);
+        auto last = std::lower_bound(first, _folds.end(), pos + removed);
+        int index = int(first - _folds.begin());
+        _folds.erase(first, last);
+        int delta = added - removed;
+        if (delta != 0)
+            for (int i = index; i < _folds.size(); i++)
+                _folds[i] += delta;
+
+        // Changed text can bring folds back, e.g. when it is pasted or restored by undo
+        auto block = editor->document()->findBlock(pos);
+        while (block.isValid() && block.position() < pos + added) {
+            const QString text = block.text();
+            const int blockPos = block.position();
+            const int end = qMin(int(text.length()), pos + added - blockPos);
+            for (int i = qMax(0, pos - blockPos); i < end; i++)
+                if (text[i] == QChar::ObjectReplacementCharacter &&
+                        formatAt(blockPos + i).objectType() == FOLDED_TEXT_TYPE)
+                    _folds.insert(index++, blockPos + i);
+            block = block.next();
+        }
+
+        // Lines following the change are renumbered
+        auto doc = editor->document();
+        auto firstBlock = doc->findBlock(pos);
+        auto lastBlock = doc->findBlock(pos + added);
+        int firstNum = firstBlock.blockNumber();
+        int lastNum = lastBlock.isValid() ? lastBlock.blockNumber() : doc->blockCount() - 1;
+        int blockDelta = doc->blockCount() - _blockCount;
+        _blockCount = doc->blockCount();
+        if (blockDelta != 0 && _dirtyFirst <= _dirtyLast) {
+            if (_dirtyFirst > firstNum)
+                _dirtyFirst = qMax(firstNum, _dirtyFirst + blockDelta);
+            if (_dirtyLast > firstNum)
+                _dirtyLast = qMax(firstNum, _dirtyLast + blockDelta);
+        }
+        markDirty(firstNum, lastNum);
+        indexBlocks(firstBlock, lastBlock);
+    }
+};
 
 //------------------------------------------------------------------------------
 //                               LineNumberArea
@@ -240,6 +747,22 @@ public:
         setGeometry(r);
     }
 
+    /// Scrolls the painted numbers along with the remembered line positions,
+    /// only the exposed area is painted then
+    void scrollLines(int dy)
+    {
+        if (_lineTopsValid) {
+            const int h = height();
+            for (auto &line : _lineTops) {
+                line.top += dy;
+                line.bottom += dy;
+            }
+            _lineTops.erase(std::remove_if(_lineTops.begin(), _lineTops.end(),
+                [h](const LineTop &line){ return line.bottom <= 0 || line.top >= h; }), _lineTops.end());
+        }
+        scroll(0, dy);
+    }
+
     int calcWidth() const
     {
         int digits = 1;
@@ -252,7 +775,12 @@ public:
         }
         const CodeEditor::Style &style = _editor->_style;
         return style.lineNumsLeftPadding + style.lineNumsRightPadding + style.lineNumsMargin +
-                fontMetrics().horizontalAdvance(QLatin1Char('9')) * digits;
+                fontMetrics().horizontalAdvance(QLatin1Char('9')) * digits + foldMarkersWidth();
+    }
+
+    int foldMarkersWidth() const
+    {
+        return _editor->_codeFolder ? fontMetrics().height() : 0;
     }
     
 protected:
@@ -277,25 +805,44 @@ protected:
             f.setPointSize(f.pointSize() - style.lineNumsFontSizeDec);
             painter.setFont(f);
         }
-    
+        if (painter.font() != _numbersFont) {
+            _numbers.clear();
+            _numbersFont = painter.font();
+        }
+        const int foldW = foldMarkersWidth();
+        const int foldX = lineNumW - style.lineNumsMargin - foldW;
+        const int textRight = foldX - style.lineNumsRightPadding;
+        auto folder = _editor->_codeFolder.get();
+
         QTextBlock block = _editor->firstVisibleBlock();
         int lineNum = block.blockNumber() + 1;
         int lineTop = qRound(_editor->blockBoundingGeometry(block).translated(_editor->contentOffset()).top());
         int lineH = qRound(_editor->blockBoundingRect(block).height());
         int lineBot = lineTop + lineH;
+
+        const bool hasHints = !_editor->_hintedBlocks->isEmpty();
+
+        // Line positions are remembered for hit-testing, painted lines replace the remembered ones
+        QVector<LineTop> painted;
+
         while (block.isValid() && lineTop <= r.bottom())
         {
             if (block.isVisible() && lineBot >= r.top())
             {
-                if (_editor->_lineHints.contains(lineNum))
+                painted << LineTop{lineTop, lineBot, lineNum};
+                auto data = hasHints ? BlockData::get(block) : nullptr;
+                if (data && !data->hint.isEmpty())
                 {
                     painter.setPen(style.lineNumsTextColorErr);
                     painter.fillRect(0, lineTop, lineNumW - style.lineNumsMargin, lineH, style.lineNumsBackColorErr);
                 }
                 else
                     painter.setPen(style.lineNumsTextColor);
-                painter.drawText(0, lineTop, lineNumW - style.lineNumsRightPadding - style.lineNumsMargin, lineH,
-                    Qt::AlignRight|Qt::AlignVCenter, QString::number(lineNum));
+                const QStaticText &text = numberText(lineNum);
+                const QSizeF sz = text.size();
+                painter.drawStaticText(QPointF(textRight - sz.width(), lineTop + (lineH - sz.height()) / 2.0), text);
+                if (folder)
+                    drawFoldMarker(painter, folder->marker(block), QRect(foldX, lineTop, foldW, lineH));
             }
             block = block.next();
             lineTop = lineBot;
@@ -303,8 +850,22 @@ protected:
             lineBot = lineTop + lineH;
             lineNum++;
         }
+        mergeLineTops(r.top(), r.bottom(), painted);
     }
     
+    void mousePressEvent(QMouseEvent *event) override
+    {
+        auto folder = _editor->_codeFolder.get();
+        int foldX = width() - _editor->_style.lineNumsMargin - foldMarkersWidth();
+        if (!folder || event->button() != Qt::LeftButton || event->pos().x() < foldX) {
+            QWidget::mousePressEvent(event);
+            return;
+        }
+        int lineNum = findLineNumber(event->pos().y());
+        if (lineNum > 0)
+            folder->toggleFold(_editor->document()->findBlockByNumber(lineNum - 1));
+    }
+
     bool event(QEvent *event) override
     {
         if (event->type() != QEvent::ToolTip)
@@ -313,8 +874,13 @@ protected:
         auto helpEvent = dynamic_cast<QHelpEvent*>(event);
         if (!helpEvent) return false;
 
-        auto hint = _editor->_lineHints.isEmpty() ? QString() :
-            _editor->_lineHints.value(findLineNumber(helpEvent->pos().y()));
+        QString hint;
+        if (!_editor->_hintedBlocks->isEmpty()) {
+            auto block = _editor->document()->findBlockByNumber(findLineNumber(helpEvent->pos().y()) - 1);
+            auto data = BlockData::get(block);
+            if (data)
+                hint = data->hint;
+        }
         if (hint.isEmpty())
             QToolTip::hideText();
         else
@@ -325,24 +891,365 @@ protected:
     
 private:
     Ori::Widgets::CodeEditor *_editor;
+    QHash<int, QStaticText> _numbers;
+    QFont _numbersFont;
+
+    // Laid out texts are cached, so scrolling doesn't shape the same numbers again
+    const QStaticText& numberText(int lineNum)
+    {
+        auto it = _numbers.constFind(lineNum);
+        if (it != _numbers.constEnd())
+            return it.value();
+        // Numbers of a few screens are enough
+        if (_numbers.size() >= 4096)
+            _numbers.clear();
+        QStaticText text(QString::number(lineNum));
+        text.setTextFormat(Qt::PlainText);
+        text.setPerformanceHint(QStaticText::AggressiveCaching);
+        text.prepare(QTransform(), _numbersFont);
+        return _numbers.insert(lineNum, text).value();
+    }
+
+    void drawFoldMarker(QPainter &painter, CodeFolder::Marker marker, const QRect &r)
+    {
+        if (marker == CodeFolder::MARKER_NONE)
+            return;
+        const qreal sz = r.width() / 4.0;
+        const QPointF c = QRectF(r).center();
+        QPolygonF triangle;
+        if (marker == CodeFolder::MARKER_FOLDED)
+            triangle << QPointF(c.x() - sz/2, c.y() - sz) << QPointF(c.x() + sz/2, c.y()) << QPointF(c.x() - sz/2, c.y() + sz);
+        else
+            triangle << QPointF(c.x() - sz, c.y() - sz/2) << QPointF(c.x() + sz, c.y() - sz/2) << QPointF(c.x(), c.y() + sz/2);
+        painter.save();
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.setPen(Qt::NoPen);
+        painter.setBrush(_editor->_style.lineNumsTextColor);
+        painter.drawPolygon(triangle);
+        painter.restore();
+    }
+
+    struct LineTop { int top; int bottom; int lineNum; };
+    QVector<LineTop> _lineTops;
+    bool _lineTopsValid = false;
+
+    void mergeLineTops(int top, int bottom, const QVector<LineTop> &painted)
+    {
+        if (top <= 0 && bottom >= height() - 1) {
+            _lineTops = painted;
+            _lineTopsValid = true;
+            return;
+        }
+        if (!_lineTopsValid)
+            return;
+        if (!painted.isEmpty()) {
+            top = qMin(top, painted.first().top);
+            bottom = qMax(bottom, painted.last().bottom - 1);
+        }
+        auto first = std::find_if(_lineTops.begin(), _lineTops.end(),
+            [top](const LineTop &line){ return line.bottom > top; });
+        auto last = std::find_if(first, _lineTops.end(),
+            [bottom](const LineTop &line){ return line.top > bottom; });
+        int pos = int(first - _lineTops.begin());
+        _lineTops.erase(first, last);
+        for (int i = 0; i < painted.size(); i++)
+            _lineTops.insert(pos + i, painted.at(i));
+    }
 
-    int findLineNumber(int y) const
+    void collectLineTops()
     {
+        _lineTops.clear();
         QTextBlock block = _editor->firstVisibleBlock();
         int lineNum = block.blockNumber() + 1;
         int lineTop = qRound(_editor->blockBoundingGeometry(block).translated(_editor->contentOffset()).top());
-        int lineBot = lineTop + qRound(_editor->blockBoundingRect(block).height());
-        while (block.isValid())
+        const int h = height();
+        while (block.isValid() && lineTop < h)
         {
-            if (y >= lineTop && y < lineBot) {
-                return lineNum;
-            }
+            int lineBot = lineTop + qRound(_editor->blockBoundingRect(block).height());
+            if (block.isVisible())
+                _lineTops << LineTop{lineTop, lineBot, lineNum};
             block = block.next();
             lineTop = lineBot;
-            lineBot = lineTop + qRound(_editor->blockBoundingRect(block).height());
             lineNum++;
         }
-        return 0;
+        _lineTopsValid = true;
+    }
+
+    int findLineNumber(int y)
+    {
+        if (!_lineTopsValid)
+            collectLineTops();
+        int lineNum = findRememberedLine(y);
+        // The point can be in the area exposed by scrolling but not painted yet
+        if (lineNum == 0) {
+            collectLineTops();
+            lineNum = findRememberedLine(y);
+        }
+        return lineNum;
+    }
+
+    int findRememberedLine(int y) const
+    {
+        auto it = std::upper_bound(_lineTops.cbegin(), _lineTops.cend(), y,
+            [](int y, const LineTop &line){ return y < line.top; });
+        if (it == _lineTops.cbegin())
+            return 0;
+        it--;
+        return y < it->bottom ? it->lineNum : 0;
+    }
+};
+
+//------------------------------------------------------------------------------
+//                                 Minimap
+//------------------------------------------------------------------------------
+
+class EditorMinimap : public QWidget
+{
+public:
+    EditorMinimap(Ori::Widgets::CodeEditor *editor) : QWidget(editor), _editor(editor)
+    {
+        setObjectName("minimap");
+        connect(editor->document(), &QTextDocument::contentsChange, this, &EditorMinimap::documentChanged);
+        connect(editor->verticalScrollBar(), &QScrollBar::valueChanged, this, [this]{ update(); });
+    }
+
+    void adjustGeometry()
+    {
+        QRect r = _editor->viewport()->geometry();
+        setGeometry(r.right() + 1, r.top(), MAP_WIDTH, r.height());
+    }
+
+    static const int MAP_WIDTH = 100;
+
+protected:
+    void paintEvent(QPaintEvent*) override
+    {
+        QPainter painter(this);
+        painter.fillRect(rect(), _editor->_style.lineNumsBackColor);
+        updateImage();
+        if (_image.isNull())
+            return;
+        painter.drawImage(QRect(0, 0, _image.width(), _rows * ROW_H), _image, QRect(0, 0, _image.width(), _rows));
+
+        // Visible part of the document
+        int first = _editor->firstVisibleBlock().blockNumber();
+        int top = rowOf(first) * ROW_H;
+        int bottom = (rowOf(lastVisibleBlock()) + 1) * ROW_H;
+        painter.fillRect(0, top, width(), bottom - top, QColor(0, 0, 0, 24));
+    }
+
+    void resizeEvent(QResizeEvent*) override
+    {
+        _allDirty = true;
+    }
+
+    void mousePressEvent(QMouseEvent *event) override
+    {
+        scrollTo(event->pos().y());
+    }
+
+    void mouseMoveEvent(QMouseEvent *event) override
+    {
+        if (event->buttons() & Qt::LeftButton)
+            scrollTo(event->pos().y());
+    }
+
+private:
+    Ori::Widgets::CodeEditor *_editor;
+    QImage _image;
+    int _blockCount = 0;
+    int _blocksPerRow = 1;
+    int _rows = 0;
+    bool _allDirty = true;
+    int _dirtyFirst = -1;
+    int _dirtyLast = -1;
+
+    static const int ROW_H = 2;
+
+    /// A row of a long document is drawn from a few blocks evenly taken from the blocks
+    /// mapped to it, then rendering all rows costs the same whatever the document size
+    static const int ROW_SAMPLES = 4;
+
+    int rowOf(int blockNum) const
+    {
+        return blockNum / _blocksPerRow;
+    }
+
+    int blocksPerRow(int blockCount) const
+    {
+        const int maxRows = qMax(1, height() / ROW_H);
+        return qMax(1, (blockCount + maxRows - 1) / maxRows);
+    }
+
+    void markDirty(int firstRow, int lastRow)
+    {
+        if (_dirtyFirst < 0 || firstRow < _dirtyFirst) _dirtyFirst = firstRow;
+        if (lastRow > _dirtyLast) _dirtyLast = lastRow;
+    }
+
+    void documentChanged(int pos, int removed, int added)
+    {
+        Q_UNUSED(removed)
+        auto doc = _editor->document();
+        auto block = doc->findBlock(pos);
+        auto last = doc->findBlock(pos + added);
+        if (!_allDirty && doc->blockCount() != _blockCount)
+            shiftRows(block.blockNumber(), last.blockNumber(), doc->blockCount());
+        while (block.isValid()) {
+            auto data = BlockData::get(block);
+            if (data)
+                data->mapValid = false;
+            if (!_allDirty) {
+                int row = rowOf(block.blockNumber());
+                markDirty(row, row);
+            }
+            if (block == last)
+                break;
+            block = block.next();
+        }
+        update();
+    }
+
+    /// Moves rendered rows following the changed blocks when lines are inserted or removed.
+    /// When a row has several blocks, its content is kept only if it gets the same blocks,
+    /// i.e. when the number of inserted or removed blocks is a multiple of blocks per row,
+    /// otherwise all rows after the change are re-rendered.
+    void shiftRows(int firstChanged, int lastChanged, int blockCount)
+    {
+        if (blocksPerRow(blockCount) != _blocksPerRow) {
+            _allDirty = true;
+            return;
+        }
+        const int delta = blockCount - _blockCount;
+        const int oldRows = _rows;
+        _blockCount = blockCount;
+        _rows = (blockCount + _blocksPerRow - 1) / _blocksPerRow;
+        if (delta % _blocksPerRow != 0) {
+            markDirty(rowOf(firstChanged), _rows - 1);
+            return;
+        }
+        const int rowDelta = delta / _blocksPerRow;
+        // The first row having only blocks after the change, in the old numbering
+        const int firstKept = rowOf(lastChanged - delta) + 1;
+        if (firstKept < oldRows) {
+            const int bytes = _image.bytesPerLine();
+            uchar *bits = _image.bits();
+            std::memmove(bits + (firstKept + rowDelta) * bytes, bits + firstKept * bytes, (oldRows - firstKept) * bytes);
+        }
+        if (_dirtyFirst >= firstKept) _dirtyFirst += rowDelta;
+        if (_dirtyLast >= firstKept) _dirtyLast += rowDelta;
+        markDirty(rowOf(firstChanged), rowOf(lastChanged));
+    }
+
+    /// Re-renders only rows having changed blocks, or all rows when they are mapped to blocks differently
+    void updateImage()
+    {
+        auto doc = _editor->document();
+        if (_allDirty) {
+            const int maxRows = qMax(1, height() / ROW_H);
+            _blockCount = doc->blockCount();
+            _blocksPerRow = blocksPerRow(_blockCount);
+            _rows = (_blockCount + _blocksPerRow - 1) / _blocksPerRow;
+            // Rows are shifted within the image when lines are inserted, so it has room for all of them
+            if (_image.width() != MAP_WIDTH || _image.height() != maxRows)
+                _image = QImage(MAP_WIDTH, maxRows, QImage::Format_ARGB32_Premultiplied);
+            _dirtyFirst = 0;
+            _dirtyLast = _rows - 1;
+            _allDirty = false;
+        }
+        if (_dirtyFirst < 0)
+            return;
+        QTextBlock block;
+        int blockNum = -1;
+        for (int row = _dirtyFirst; row <= _dirtyLast && row < _rows; row++) {
+            auto line = reinterpret_cast<QRgb*>(_image.scanLine(row));
+            std::fill(line, line + MAP_WIDTH, 0);
+            const int firstBlock = firstBlockOfRow(row);
+            const int rowBlocks = firstBlockOfRow(row + 1) - firstBlock;
+            const int samples = qMin(rowBlocks, ROW_SAMPLES);
+            for (int i = 0; i < samples; i++) {
+                int num = firstBlock + i * rowBlocks / samples;
+                block = num == blockNum + 1 && block.isValid() ? block.next() : doc->findBlockByNumber(num);
+                blockNum = num;
+                if (!block.isValid())
+                    break;
+                auto data = summarize(block);
+                int end = qMin(MAP_WIDTH, data->mapIndent + data->mapLength);
+                for (int x = data->mapIndent; x < end; x++)
+                    if (!line[x])
+                        line[x] = data->mapColor;
+            }
+        }
+        _dirtyFirst = -1;
+        _dirtyLast = -1;
+    }
+
+    int firstBlockOfRow(int row) const
+    {
+        return qMin(row * _blocksPerRow, _blockCount);
+    }
+
+    int lastVisibleBlock() const
+    {
+        auto block = _editor->firstVisibleBlock();
+        int last = block.blockNumber();
+        const QPointF offset = _editor->contentOffset();
+        const int viewH = _editor->viewport()->height();
+        for (; block.isValid(); block = block.next()) {
+            if (!block.isVisible())
+                continue;
+            if (_editor->blockBoundingGeometry(block).translated(offset).top() >= viewH)
+                break;
+            last = block.blockNumber();
+        }
+        return last;
+    }
+
+    /// Returns cached summary of the block, it's recalculated only when the block has been changed
+    BlockData* summarize(QTextBlock block)
+    {
+        auto data = BlockData::obtain(block);
+        if (data->mapValid)
+            return data;
+        const QString text = block.text();
+        const int tabWidth = qMax(1, _editor->tabWidth());
+        int indent = 0;
+        int i = 0;
+        for (; i < text.length(); i++) {
+            if (text[i] == ' ')
+                indent++;
+            else if (text[i] == '\t')
+                indent = (indent / tabWidth + 1) * tabWidth;
+            else
+                break;
+        }
+        data->mapIndent = indent;
+        data->mapLength = text.length() - i;
+
+        // The color of the largest part of the block
+        QColor color = _editor->palette().color(QPalette::Text);
+        int maxLength = 0;
+        const auto formats = block.layout()->formats();
+        for (const auto &f : formats)
+            if (f.length > maxLength && f.format.hasProperty(QTextFormat::ForegroundBrush)) {
+                maxLength = f.length;
+                color = f.format.foreground().color();
+            }
+        // Premultiplied with half opacity to look lighter than text
+        color.setAlpha(128);
+        data->mapColor = qPremultiply(color.rgba());
+        data->mapValid = true;
+        return data;
+    }
+
+    void scrollTo(int y)
+    {
+        if (_rows == 0)
+            return;
+        int row = qBound(0, y / ROW_H, _rows - 1);
+        int count = lastVisibleBlock() - _editor->firstVisibleBlock().blockNumber() + 1;
+        // In a plain text edit, the vertical scroll bar counts lines
+        _editor->verticalScrollBar()->setValue(firstBlockOfRow(row) - count / 2);
     }
 };
 
@@ -369,108 +1276,173 @@ void FoldedTextView::drawObject(QPainter *painter, const QRectF &rect, QTextDocu
 }
 
 //------------------------------------------------------------------------------
-//                                CodeFolder
+//                               CodeLoader
 //------------------------------------------------------------------------------
 
-class CodeFolder
+struct LoadedChunk
+{
+    QString text;
+    qint64 bytesRead = 0;
+    qint64 bytesTotal = 0;
+    bool last = false;
+    QString error;
+};
+
+struct LoadLink : WorkerLink<LoadedChunk>
+{
+    // Limits the number of chunks read but not yet appended to the editor
+    QSemaphore freeChunks {4};
+};
+
+// Reads a file in a worker thread splitting it into chunks at line ends
+class CodeLoader : public QRunnable
 {
 public:
-    CodeFolder(CodeEditor *editor): editor(editor) {}
+    QString fileName;
+    QSharedPointer<LoadLink> link;
 
-    void foldCodeBlock(int tabWidth, CodeEditor::FoldingType foldMode)
+    void run() override
     {
-        Q_UNUSED(foldMode)
-    
-        auto block = editor->textCursor().block();
-        
-        // TODO: add support for more type of blocks when needed
-        auto codeBlock = findPythonCodeBlock(block, tabWidth);
-        if (!codeBlock.ok())
+        LoadedChunk chunk;
+        QFile f(fileName);
+        if (!f.open(QIODevice::ReadOnly|QIODevice::Text)) {
+            chunk.error = f.errorString();
+            chunk.last = true;
+            deliver(chunk);
             return;
-        
-        QTextCursor foldCursor(editor->document());
-        foldCursor.setPosition(block.position() + codeBlock.mountPos);
-        QTextBlock endBlock = editor->document()->findBlockByNumber(codeBlock.endLine);
-        foldCursor.setPosition(endBlock.position() + endBlock.length() - 1, QTextCursor::KeepAnchor);
-        
-        foldSelection(foldCursor);
-        
-        // Position the cursor after the folded block symbol
-        QTextCursor newCursor(editor->document());
-        newCursor.setPosition(block.position() + codeBlock.mountPos + 1);
-        editor->setTextCursor(newCursor);
-    }
-    
-    void foldSelection(QTextCursor c)
-    {
-        QTextCharFormat f;
-        f.setObjectType(FOLDED_TEXT_TYPE);
-        f.setProperty(FOLDED_TEXT_PROP, QVariant::fromValue(c.selection()));
-        c.insertText(QString(QChar::ObjectReplacementCharacter), f);
+        }
+        chunk.bytesTotal = f.size();
+        QByteArray tail;
+        while (!chunk.last) {
+            QByteArray data = tail + f.read(CHUNK_SIZE);
+            if (f.error() != QFileDevice::NoError) {
+                chunk.error = f.errorString();
+                chunk.last = true;
+                deliver(chunk);
+                return;
+            }
+            chunk.last = f.atEnd();
+            // A chunk is cut after a line break, so it never ends in the middle of a UTF-8 sequence
+            int lineEnd = chunk.last ? data.size()-1 : data.lastIndexOf('\n');
+            if (lineEnd < 0 && !chunk.last) {
+                tail = data;
+                continue;
+            }
+            tail = data.mid(lineEnd+1);
+            data.truncate(lineEnd+1);
+            chunk.text = QString::fromUtf8(data);
+            chunk.bytesRead = f.pos();
+            if (!deliver(chunk))
+                return;
+        }
     }
-    
-    void unfold()
+
+private:
+    static const int CHUNK_SIZE = 4 * 1024 * 1024;
+
+    bool deliver(const LoadedChunk& chunk)
     {
-        auto c = editor->textCursor();
-        if (c.hasSelection())
-            return;
-        
-        auto f = c.charFormat();
-        if (f.objectType() != FOLDED_TEXT_TYPE)
-            return;
-    
-        c.movePosition(c.Left, c.KeepAnchor);
-        c.insertFragment(f.property(FOLDED_TEXT_PROP).value<QTextDocumentFragment>());
+        while (!link->freeChunks.tryAcquire(1, 100))
+            if (link->isCancelled())
+                return false;
+        return link->deliver(chunk);
     }
-    
-    bool hasFoldings() const
+};
+
+//------------------------------------------------------------------------------
+//                               CodeSaver
+//------------------------------------------------------------------------------
+
+struct PendingSave
+{
+    QString fileName;
+    QString code;
+};
+
+struct SaveLink : WorkerLink<QString>
+{
+    // Released when the saver has written its own file
+    QSemaphore written;
+    // Saves left by the editor deleted while the saver is running,
+    // the saver writes them after its own file, so the order of requests is kept
+    QMutex orphansMutex;
+    QVector<PendingSave> orphans;
+    bool finished = false;
+};
+
+// Writes a snapshot of the code in a worker thread.
+// The file is written even if the editor has been deleted in the meantime.
+class CodeSaver : public QRunnable
+{
+public:
+    QString fileName;
+    QString code;
+    QSharedPointer<SaveLink> link;
+
+    void run() override
     {
-        auto block = editor->document()->firstBlock();
-        while (block.isValid()) {
-            QString text = block.text();
-            for (int i = 0; i < text.length(); i++) {
-                if (text[i] == QChar::ObjectReplacementCharacter) {
-                    QTextCursor cursor(block);
-                    cursor.setPosition(block.position() + i);
-                    cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
-                    if (cursor.charFormat().objectType() == FOLDED_TEXT_TYPE)
-                        return true;
-                }
+        QString error = writeCodeFile(fileName, code);
+        link->written.release();
+        link->deliver(error);
+        while (true) {
+            QMutexLocker locker(&link->orphansMutex);
+            if (link->orphans.isEmpty()) {
+                link->finished = true;
+                return;
             }
-            block = block.next();
+            auto save = link->orphans.takeFirst();
+            locker.unlock();
+            // There is no editor to report to
+            error = writeCodeFile(save.fileName, save.code);
+            if (!error.isEmpty())
+                qWarning() << "Failed to save" << save.fileName << error;
         }
-        return false;
     }
+};
 
-    QString toUnfoldedText() const
+struct CodeEditor::SavingState
+{
+    QSharedPointer<SaveLink> link;
+    QString fileName;
+    // Saves requested while another one is in progress, one per file in order of requests,
+    // a later request to the same file replaces the code of the pending one
+    QVector<PendingSave> pending;
+
+    ~SavingState()
     {
-        QString result;
-        QTextStream out(&result);
-        QTextBlock block = editor->document()->firstBlock();
-        while (block.isValid()) {
-            QString line = block.text();
-            for (int i = 0; i < line.length(); i++) {
-                if (line[i] == QChar::ObjectReplacementCharacter) {
-                    QTextCursor cursor(block);
-                    cursor.setPosition(block.position() + i);
-                    cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
-                    QTextCharFormat format = cursor.charFormat();
-                    if (format.objectType() == FOLDED_TEXT_TYPE) {
-                        auto fragment = format.property(FOLDED_TEXT_PROP).value<QTextDocumentFragment>();
-                        out << fragment.toPlainText();
-                        continue;
-                    }
-                }
-                out << line[i];
-            }
-            block = block.next();
-            if (block.isValid())
-                out << "\n";
+        link->cancel();
+        if (pending.isEmpty())
+            return;
+        // The editor is deleted before all its saves are done, they are still written
+        // after the running one, but without `savingFinished()`
+        QMutexLocker locker(&link->orphansMutex);
+        if (!link->finished) {
+            link->orphans = pending;
+            return;
         }
-        return result;
+        locker.unlock();
+        auto saver = new CodeSaver;
+        saver->fileName = pending.first().fileName;
+        saver->code = pending.first().code;
+        saver->link.reset(new SaveLink);
+        saver->link->cancel();
+        saver->link->orphans = pending.mid(1);
+        QThreadPool::globalInstance()->start(saver);
+    }
+};
+
+struct CodeEditor::LoadingState
+{
+    QSharedPointer<LoadLink> link;
+    bool readOnly;
+    bool showWhitespaces;
+    bool undoRedo;
+    QVector<QPointer<QSyntaxHighlighter>> highlighters;
+
+    ~LoadingState()
+    {
+        link->cancel();
     }
-    
-    CodeEditor *editor;
 };
 
 //------------------------------------------------------------------------------
@@ -483,6 +1455,7 @@ CodeEditor::CodeEditor(QWidget *parent) : QPlainTextEdit(parent)
     setTabStopDistance(40); // twice less that the default
 
     _lineNums = new EditorLineNums(this);
+    _hintedBlocks.reset(new QSet<BlockData*>);
 
     _style.backColor = Qt::white;
     _style.readonlyBackColor = QColor(0xfffafafa);
@@ -507,28 +1480,200 @@ CodeEditor::CodeEditor(QWidget *parent) : QPlainTextEdit(parent)
     highlightCurrentLine();
 }
 
+CodeEditor::~CodeEditor()
+{
+}
+
 bool CodeEditor::loadCode(const QString &fileName)
 {
+    cancelLoading();
     QFile f(fileName);
     if (!f.open(QIODevice::ReadOnly|QIODevice::Text)) {
         qWarning() << "Failed to open" << fileName << f.errorString();
         return false;
     }
+    if (_largeFileSize > 0 && f.size() > _largeFileSize) {
+        f.close();
+        startLoading(fileName, f.size());
+        return true;
+    }
     setCode(QString::fromUtf8(f.readAll()));
     return true;
 }
 
+void CodeEditor::startLoading(const QString &fileName, qint64 fileSize)
+{
+    _loading.reset(new LoadingState);
+    _loading->readOnly = isReadOnly();
+    _loading->showWhitespaces = showWhitespaces();
+    _loading->undoRedo = document()->isUndoRedoEnabled();
+
+    // Highlighters would rehighlight each appended chunk, they are reattached when loading is done
+    auto highlighters = findChildren<QSyntaxHighlighter*>() + document()->findChildren<QSyntaxHighlighter*>();
+    for (auto h : highlighters)
+        if (h->document() == document()) {
+            h->setDocument(nullptr);
+            _loading->highlighters << h;
+        }
+
+    setReadOnly(true);
+    setShowWhitespaces(false);
+    viewport()->update();
+    setPlainText(QString());
+    document()->setUndoRedoEnabled(false);
+    emit loadingProgress(0, fileSize);
+
+    QSharedPointer<LoadLink> link(new LoadLink);
+    link->post = [this, l = link.data(), fileName](const LoadedChunk& chunk){
+        QMetaObject::invokeMethod(this, [this, l, fileName, chunk]{
+            if (!_loading || _loading->link.data() != l)
+                return;
+            if (!chunk.text.isEmpty()) {
+                QTextCursor cursor(document());
+                cursor.movePosition(QTextCursor::End);
+                cursor.insertText(chunk.text);
+            }
+            l->freeChunks.release();
+            if (!chunk.error.isEmpty())
+                qWarning() << "Failed to load" << fileName << chunk.error;
+            else
+                emit loadingProgress(chunk.bytesRead, chunk.bytesTotal);
+            if (chunk.last)
+                finishLoading(chunk.error.isEmpty());
+        }, Qt::QueuedConnection);
+    };
+    _loading->link = link;
+
+    auto loader = new CodeLoader;
+    loader->fileName = fileName;
+    loader->link = link;
+    QThreadPool::globalInstance()->start(loader);
+}
+
+void CodeEditor::finishLoading(bool ok)
+{
+    std::unique_ptr<LoadingState> loading(_loading.release());
+    document()->setUndoRedoEnabled(loading->undoRedo);
+    document()->setModified(false);
+    setReadOnly(loading->readOnly);
+    setShowWhitespaces(loading->showWhitespaces);
+    for (auto& h : loading->highlighters)
+        if (h)
+            h->setDocument(document());
+    moveCursor(QTextCursor::Start);
+    highlightCurrentLine();
+    emit loadingFinished(ok);
+}
+
+void CodeEditor::cancelLoading()
+{
+    if (_loading)
+        finishLoading(false);
+}
+
 bool CodeEditor::saveCode(const QString &fileName)
 {
-    QFile f(fileName);
-    if (!f.open(QIODevice::WriteOnly|QIODevice::Text|QIODevice::Truncate)){
-        qWarning() << "Failed to open" << fileName << f.errorString();
+    if (_saving) {
+        // Older asynchronous saves of the same file must not overwrite this one
+        auto &pending = _saving->pending;
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+            [&fileName](const PendingSave &save){ return save.fileName == fileName; }), pending.end());
+        if (_saving->fileName == fileName) {
+            _saving->link->written.acquire();
+            _saving->link->written.release();
+        }
+    }
+    QString error = writeCodeFile(fileName, code());
+    if (!error.isEmpty()) {
+        qWarning() << "Failed to save" << fileName << error;
         return false;
     }
-    f.write(code().toUtf8());
     return true;
 }
 
+void CodeEditor::saveCodeAsync(const QString &fileName)
+{
+    if (_saving) {
+        for (auto &save : _saving->pending)
+            if (save.fileName == fileName) {
+                save.code = code();
+                return;
+            }
+        _saving->pending << PendingSave{fileName, code()};
+        return;
+    }
+    startSaving(fileName, code());
+}
+
+void CodeEditor::startSaving(const QString &fileName, const QString &code)
+{
+    QSharedPointer<SaveLink> link(new SaveLink);
+    link->post = [this, l = link.data(), fileName](const QString& error){
+        QMetaObject::invokeMethod(this, [this, l, fileName, error]{
+            if (!_saving || _saving->link.data() != l)
+                return;
+            std::unique_ptr<SavingState> saving(_saving.release());
+            if (!saving->pending.isEmpty()) {
+                auto next = saving->pending.takeFirst();
+                startSaving(next.fileName, next.code);
+                _saving->pending = std::move(saving->pending);
+            }
+            if (!error.isEmpty())
+                qWarning() << "Failed to save" << fileName << error;
+            emit savingFinished(fileName, error);
+        }, Qt::QueuedConnection);
+    };
+    _saving.reset(new SavingState);
+    _saving->link = link;
+    _saving->fileName = fileName;
+
+    auto saver = new CodeSaver;
+    saver->fileName = fileName;
+    saver->code = code;
+    saver->link = link;
+    QThreadPool::globalInstance()->start(saver);
+}
+
+QMap<int, QString> CodeEditor::lineHints() const
+{
+    // Block data doesn't know its block, so line numbers are only found by walking the document
+    QMap<int, QString> hints;
+    auto block = document()->firstBlock();
+    while (block.isValid() && hints.size() < _hintedBlocks->size()) {
+        auto data = BlockData::get(block);
+        if (data && !data->hint.isEmpty())
+            hints.insert(block.blockNumber() + 1, data->hint);
+        block = block.next();
+    }
+    return hints;
+}
+
+void CodeEditor::setLineHints(const QMap<int, QString>& hints)
+{
+    for (auto data : std::as_const(*_hintedBlocks)) {
+        data->hint.clear();
+        data->hinted.reset();
+    }
+    _hintedBlocks->clear();
+    for (auto it = hints.constBegin(); it != hints.constEnd(); it++) {
+        if (it.value().isEmpty())
+            continue;
+        auto block = document()->findBlockByNumber(it.key() - 1);
+        if (!block.isValid())
+            continue;
+        auto data = BlockData::obtain(block);
+        data->hint = it.value();
+        data->hinted = _hintedBlocks;
+        _hintedBlocks->insert(data);
+    }
+    _lineNums->update();
+}
+
+void CodeEditor::clearLineHints()
+{
+    setLineHints({});
+}
+
 QString CodeEditor::code() const
 {
     if (_codeFolder && _codeFolder->hasFoldings())
@@ -540,6 +1685,8 @@ void CodeEditor::resizeEvent(QResizeEvent *e)
 {
     QPlainTextEdit::resizeEvent(e);
     _lineNums->adjustGeometry(contentsRect());
+    if (_minimap)
+        _minimap->adjustGeometry();
 }
 
 void CodeEditor::keyPressEvent(QKeyEvent *e)
@@ -582,28 +1729,74 @@ void CodeEditor::keyPressEvent(QKeyEvent *e)
 
 void CodeEditor::onBlockCountChanged()
 {
-    setViewportMargins(_lineNums->calcWidth(), 0, 0, 0);
+    updateViewportMargins();
+}
+
+void CodeEditor::updateViewportMargins()
+{
+    setViewportMargins(_lineNums->calcWidth(), 0, _minimap ? EditorMinimap::MAP_WIDTH : 0, 0);
+    if (_minimap)
+        _minimap->adjustGeometry();
+}
+
+void CodeEditor::setShowMinimap(bool on)
+{
+    if (on == showMinimap())
+        return;
+    if (on) {
+        _minimap = new EditorMinimap(this);
+        _minimap->show();
+    } else {
+        delete _minimap;
+        _minimap = nullptr;
+    }
+    updateViewportMargins();
 }
 
 void CodeEditor::onDocUpdateRequest(const QRect &rect, int dy)
 {
     if (dy)
-        _lineNums->scroll(0, dy);
+        _lineNums->scrollLines(dy);
     else
         _lineNums->update(0, rect.y(), _lineNums->width(), rect.height());
 
     if (rect.contains(viewport()->rect()))
-        setViewportMargins(_lineNums->calcWidth(), 0, 0, 0);
+        updateViewportMargins();
 }
 
+// The current line is painted by the editor itself instead of being an extra selection,
+// so moving the cursor doesn't make the editor to merge and relayout marks of other features
 void CodeEditor::highlightCurrentLine()
 {
-    QTextEdit::ExtraSelection selection;
-    selection.format.setBackground(_style.currentLineColor);
-    selection.format.setProperty(QTextFormat::FullWidthSelection, true);
-    selection.cursor = textCursor();
-    selection.cursor.clearSelection();
-    setExtraSelections({selection});
+    if (!_currentLine.isNull())
+        viewport()->update(lineRect(_currentLine));
+    _currentLine = textCursor();
+    _currentLine.clearSelection();
+    viewport()->update(lineRect(_currentLine));
+}
+
+QRect CodeEditor::lineRect(const QTextCursor &cursor) const
+{
+    auto block = cursor.block();
+    if (!block.isValid() || !block.isVisible())
+        return QRect();
+    auto r = blockBoundingGeometry(block).translated(contentOffset());
+    auto line = block.layout() ? block.layout()->lineForTextPosition(cursor.positionInBlock()) : QTextLine();
+    if (line.isValid())
+        r = QRectF(r.left(), r.top() + line.y(), r.width(), line.height());
+    return QRectF(0, r.top(), viewport()->width(), r.height()).toAlignedRect();
+}
+
+void CodeEditor::paintEvent(QPaintEvent *e)
+{
+    if (!_loading) {
+        auto r = lineRect(textCursor());
+        if (r.intersects(e->rect())) {
+            QPainter painter(viewport());
+            painter.fillRect(r, _style.currentLineColor);
+        }
+    }
+    QPlainTextEdit::paintEvent(e);
 }
 
 void CodeEditor::setShowWhitespaces(bool on)
@@ -767,6 +1960,7 @@ void CodeEditor::normalize(NormalizationOptions options)
     auto cursor = textCursor();
     auto backupPos = cursor.position();
     cursor.beginEditBlock();
+    LinesEdit edit;
     auto block = document()->firstBlock();
     while (block.isValid()) {
         QString origLine = block.text();
@@ -781,13 +1975,10 @@ void CodeEditor::normalize(NormalizationOptions options)
             if (!isEmpty(normLine))
                 normLine = normalizeIndent(normLine);
         }
-        if (normLine != origLine) {
-            QTextCursor lineCursor(block);
-            lineCursor.select(QTextCursor::LineUnderCursor);
-            lineCursor.insertText(normLine);
-        }
+        edit.add(origLine, normLine);
         block = block.next();
     }
+    edit.apply(document(), 0);
     if (options & NormFinalNewline) {
         auto lastBlock = document()->lastBlock();
         if (lastBlock.isValid() && !lastBlock.text().isEmpty()) {
@@ -811,12 +2002,21 @@ void CodeEditor::setFoldingType(FoldingType ft)
         _codeFolder = {};
     else if (!_codeFolder)
         _codeFolder.reset(new CodeFolder(this));
+    // Fold markers column has been shown or hidden
+    onBlockCountChanged();
+    _lineNums->adjustGeometry(contentsRect());
 }
 
 void CodeEditor::fold()
 {
     if (_codeFolder)
-        _codeFolder->foldCodeBlock(_tabWidth, _foldingType);
+        _codeFolder->foldCodeBlock(_foldingType);
+}
+
+void CodeEditor::foldAll()
+{
+    if (_codeFolder)
+        _codeFolder->foldAll();
 }
 
 void CodeEditor::unfold()
@@ -827,8 +2027,8 @@ void CodeEditor::unfold()
 
 void CodeEditor::unfoldAll()
 {
-    if (_codeFolder && _codeFolder->hasFoldings())
-        setPlainText(_codeFolder->toUnfoldedText());
+    if (_codeFolder)
+        _codeFolder->unfoldAll();
 }
 
 } // namespace Widgets
@@ -2,12 +2,16 @@
 #define ORI_CODE_EDITOR_H
 
 #include <QPlainTextEdit>
+#include <QSet>
+
+#include <memory>
 
 /**
 
 A wrapper around QPlainTextEdit providing several additional features conventional for code editors
 
 - line numbering
+- minimap
 - current line highlighting
 - line hints for error highlighting
 - tab to space replacement
@@ -15,13 +19,16 @@ A wrapper around QPlainTextEdit providing several additional features convention
 - automatic block indentation
 - smart home key
 - document normalization
+- code folding with fold markers in the line numbers gutter
 
 */
 
 namespace Ori {
 namespace Widgets {
 
+class BlockData;
 class EditorLineNums;
+class EditorMinimap;
 class CodeFolder;
 
 class FoldedTextView : public QObject, public QTextObjectInterface
@@ -40,14 +47,39 @@ class CodeEditor : public QPlainTextEdit
 
 public:
     explicit CodeEditor(QWidget *parent = nullptr);
+    ~CodeEditor();
 
+    /// Files larger than `largeFileSize()` are loaded in large-file mode.
+    /// The file is read in a worker thread and appended to the editor in chunks,
+    /// then the function returns as soon as loading has started. Until `loadingFinished()`
+    /// the editor is read-only, and current line highlighting, whitespace rendering
+    /// and syntax highlighters attached to the document are suspended.
     bool loadCode(const QString &fileName);
     bool saveCode(const QString &fileName);
+    /// Writes a snapshot of the code in a worker thread and emits `savingFinished()`.
+    /// Files are written via QSaveFile by both save functions, so they are never left truncated.
+    /// When another save is requested while the previous one is in progress, it is postponed.
+    /// Postponed saves are written one after another, and only the latest of postponed requests
+    /// to the same file is written. `savingFinished()` is emitted for each written file.
+    /// When the editor is deleted, its postponed saves are still written, but nothing is emitted for them.
+    /// `saveCode()` supersedes asynchronous saves of the same file requested before it:
+    /// postponed ones are dropped, and it waits for the running one to be written.
+    void saveCodeAsync(const QString &fileName);
+    bool isSaving() const { return bool(_saving); }
     void setCode(const QString &code) { setPlainText(code); }
     QString code() const;
+
+    qint64 largeFileSize() const { return _largeFileSize; }
+    void setLargeFileSize(qint64 bytes) { _largeFileSize = bytes; }
+    bool isLoading() const { return bool(_loading); }
+    /// Stops loading in large-file mode, the text loaded so far stays in the editor
+    void cancelLoading();
     
-    QMap<int, QString> lineHints() const { return _lineHints; }
-    void setLineHints(const QMap<int, QString>& hints) { _lineHints = hints; update(); }
+    /// Hints are attached to text blocks, so they move along with their lines when the text is edited.
+    /// A hint is lost when its line is deleted. Line numbers are 1-based.
+    QMap<int, QString> lineHints() const;
+    void setLineHints(const QMap<int, QString>& hints);
+    void clearLineHints();
     
     bool showWhitespaces() const;
     void setShowWhitespaces(bool on);
@@ -99,20 +131,35 @@ public:
     Style style() const { return _style; }
     void setStyle(const Style &s) { _style = s; }
 
+    /// The minimap is drawn on the right side of the editor from cached line summaries,
+    /// they are recalculated only for changed lines
+    bool showMinimap() const { return _minimap; }
+    void setShowMinimap(bool on);
+
     enum FoldingType { FOLD_NONE, FOLD_PYTHON };
     FoldingType foldingType() const { return _foldingType; }
     void setFoldingType(FoldingType f);
     void fold();
+    void foldAll();
     void unfold();
     void unfoldAll();
+
+signals:
+    void loadingProgress(qint64 bytesRead, qint64 bytesTotal);
+    /// Emitted when loading in large-file mode is completed, failed, or cancelled
+    void loadingFinished(bool ok);
+    /// Emitted when an asynchronous save is done, the error is empty on success
+    void savingFinished(const QString &fileName, const QString &error);
     
 protected:
     void resizeEvent(QResizeEvent *e) override;
     void keyPressEvent(QKeyEvent *e) override;
+    void paintEvent(QPaintEvent *e) override;
 
 private:
     class EditorLineNums *_lineNums;
-    QMap<int, QString> _lineHints;
+    class EditorMinimap *_minimap = nullptr;
+    std::shared_ptr<QSet<BlockData*>> _hintedBlocks;
     Style _style;
     bool _replaceTabs = true;
     bool _autoIndent = true;
@@ -121,11 +168,22 @@ private:
     QString _blockStartSymbol = ":";
     FoldingType _foldingType = FOLD_NONE;
     std::shared_ptr<CodeFolder> _codeFolder;
+    qint64 _largeFileSize = 16 * 1024 * 1024;
+    struct LoadingState;
+    std::unique_ptr<LoadingState> _loading;
+    struct SavingState;
+    std::unique_ptr<SavingState> _saving;
+    QTextCursor _currentLine;
     
     void onBlockCountChanged();
     void onDocUpdateRequest(const QRect &rect, int dy);
+    void updateViewportMargins();
+    void startLoading(const QString &fileName, qint64 fileSize);
+    void finishLoading(bool ok);
+    void startSaving(const QString &fileName, const QString &code);
 
     void highlightCurrentLine();
+    QRect lineRect(const QTextCursor &cursor) const;
     
     QString normalizeIndent(const QString& line) const;
     QString removeOneIndent(const QString& line) const;
@@ -136,6 +194,7 @@ private:
     void handleSmartHome(bool select);
     
     friend class EditorLineNums;
+    friend class EditorMinimap;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(CodeEditor::NormalizationOptions)